@@ -0,0 +1,69 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+inline std::vector<Benchmark>& registry() {
+    static std::vector<Benchmark> benchmarks;
+    return benchmarks;
+}
+
+struct Registrar {
+    Registrar(const char* name, void (*run)()) { registry().push_back({name, run}); }
+};
+
+#define BENCHMARK(name)                                          \
+    static void bench_##name();                                  \
+    static ::bench::Registrar registrar_##name(#name, bench_##name); \
+    static void bench_##name()
+
+// Runs fn repeatedly and returns the fastest run in seconds
+inline double measure(const std::function<void()>& fn, int repetitions = 5) {
+    double best = 1e30;
+    for (int i = 0; i < repetitions; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+        best = std::min(best, duration.count());
+    }
+
+    return best;
+}
+
+inline double megabytesPerSecond(size_t bytes, double seconds) {
+    return static_cast<double>(bytes) / (1024.0 * 1024.0) / seconds;
+}
+
+// Synthetic program made of many small functions with deep indentation and comment banners,
+// roughly the shape of our generated sources.
+inline std::string generateProgram(size_t functions) {
+    std::string program;
+    for (size_t i = 0; i < functions; i++) {
+        std::string name = "func" + std::to_string(i);
+        program += "////////////////////////////////////////////////////////////////////////\n";
+        program += "// " + name + ": generated accessor, do not edit by hand\n";
+        program += "////////////////////////////////////////////////////////////////////////\n";
+        program += name + "(a, b) {\n";
+        program += "        auto result = a + b * 3;\n";
+        program += "        if (result > 100) {\n";
+        program += "                // clamp the result to the valid range of the table\n";
+        program += "                result = 100;\n";
+        program += "        }\n";
+        program += "        return result;\n";
+        program += "}\n\n";
+    }
+
+    return program;
+}
+
+}  // end namespace bench
@@ -0,0 +1,115 @@
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "bench.hpp"
+#include "lexer.hpp"
+#include "scan.hpp"
+
+using namespace clonk;
+
+static size_t lexAll(std::string_view program, const ScanKernels& kernels) {
+    TokenStream ts(program, kernels);
+    size_t tokens = 0;
+    while (ts.next().type != TokenType::EndOfFile) {
+        tokens++;
+    }
+
+    return tokens;
+}
+
+BENCHMARK(lexer_throughput) {
+    std::string program = bench::generateProgram(200000);
+
+    for (const ScanKernels* kernels : {&ScanKernels::scalar(), &ScanKernels::best()}) {
+        size_t tokens = 0;
+        double seconds = bench::measure([&] { tokens = lexAll(program, *kernels); });
+
+        std::printf("%-8s %8.1f MB/s  (%zu bytes, %zu tokens)\n", kernels->name,
+                    bench::megabytesPerSecond(program.size(), seconds), program.size(), tokens);
+    }
+}
+
+// Identifier-dense input: long declaration lists mixing keywords and identifiers.
+static std::string generateIdentifierProgram(size_t functions) {
+    std::string program;
+    for (size_t i = 0; i < functions; i++) {
+        program += "f" + std::to_string(i) + "(alpha, beta, gamma) {\n";
+        program += "auto value = alpha; register index = beta; auto elsewhere = gamma;\n";
+        program += "while (index) { if (value) { value = elsewhere; } else { index = alpha; } }\n";
+        program += "return value;\n}\n";
+    }
+
+    return program;
+}
+
+BENCHMARK(keyword_lookup) {
+    std::string program = generateIdentifierProgram(200000);
+
+    // in TokenType order
+    const std::string_view keywordNames[] = {"auto", "register", "if", "else", "while", "return"};
+
+    std::vector<std::string_view> words;
+    TokenStream ts(program);
+    for (Token token = ts.next(); token.type != TokenType::EndOfFile; token = ts.next()) {
+        if (token.type == TokenType::IdentifierType) {
+            words.push_back(token.getIdentifier());
+        } else if (token.type >= TokenType::KeyAuto && token.type <= TokenType::KeyReturn) {
+            words.push_back(keywordNames[token.type - TokenType::KeyAuto]);
+        }
+    }
+
+    // the hash map lookup used before
+    const std::unordered_map<std::string_view, TokenType> keywords = {
+        {"auto", TokenType::KeyAuto},         {"return", TokenType::KeyReturn},
+        {"register", TokenType::KeyRegister}, {"if", TokenType::KeyIf},
+        {"else", TokenType::KeyElse},         {"while", TokenType::KeyWhile},
+    };
+
+    // the hits are printed, so the loops can't be optimized away
+    size_t mapHits = 0;
+    double mapSeconds = bench::measure([&] {
+        mapHits = 0;
+        for (std::string_view word : words) {
+            if (keywords.find(word) != keywords.end()) {
+                mapHits += keywords.at(word);
+            }
+        }
+    });
+
+    size_t switchHits = 0;
+    double switchSeconds = bench::measure([&] {
+        switchHits = 0;
+        for (std::string_view word : words) {
+            TokenType type = classifyWord(word);
+            if (type != TokenType::IdentifierType) {
+                switchHits += type;
+            }
+        }
+    });
+
+    std::printf("%zu words\n", words.size());
+    std::printf("unordered_map %8.2f ns/word  (%zu hits)\n", mapSeconds * 1e9 / words.size(),
+                mapHits);
+    std::printf("switch        %8.2f ns/word  (%zu hits)\n", switchSeconds * 1e9 / words.size(),
+                switchHits);
+
+    size_t tokens = 0;
+    double lexSeconds = bench::measure([&] { tokens = lexAll(program, ScanKernels::best()); });
+    std::printf("lexer         %8.1f MB/s  (%zu tokens)\n",
+                bench::megabytesPerSecond(program.size(), lexSeconds), tokens);
+}
+
+// Literal-heavy input: big constant tables written element by element.
+BENCHMARK(literal_table) {
+    std::string program = "table(t) {\n";
+    for (size_t i = 0; i < 2000000; i++) {
+        program += "    t[" + std::to_string(i) + "] = " + std::to_string(i * 2654435761u) + ";\n";
+    }
+    program += "}\n";
+
+    size_t tokens = 0;
+    double seconds = bench::measure([&] { tokens = lexAll(program, ScanKernels::best()); });
+    std::printf("lexer %8.1f MB/s  (%zu bytes, %zu tokens)\n",
+                bench::megabytesPerSecond(program.size(), seconds), program.size(), tokens);
+}
@@ -0,0 +1,29 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include "bench.hpp"
+
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::strcmp(argv[1], "-h") == 0) {
+        std::cerr << "usage: ./clonk-bench [benchmark...]\n    available benchmarks:";
+        for (const auto& benchmark : bench::registry()) {
+            std::cerr << " " << benchmark.name;
+        }
+        std::cerr << "\n";
+        return EXIT_FAILURE;
+    }
+
+    for (const auto& benchmark : bench::registry()) {
+        bool selected = argc == 1;
+        for (int i = 1; i < argc; i++) {
+            selected |= std::strcmp(argv[i], benchmark.name) == 0;
+        }
+
+        if (selected) {
+            std::cout << "== " << benchmark.name << "\n";
+            benchmark.run();
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,595 @@
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Support/raw_os_ostream.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "ast.hpp"
+#include "ast_cache.hpp"
+#include "bench.hpp"
+#include "codegen.hpp"
+#include "flat_ast.hpp"
+#include "lexer.hpp"
+#include "parser.hpp"
+#include "printer.hpp"
+#include "source.hpp"
+
+using namespace clonk;
+
+// peak resident set size of the process so far, in KiB
+static long peakRSS() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+// Run on its own for meaningful RSS numbers, the peak is process wide.
+BENCHMARK(ast_allocation) {
+    std::string program = bench::generateProgram(200000);
+    long rssBefore = peakRSS();
+
+    double parseSeconds = 1e30;
+    double destroySeconds = 1e30;
+
+    for (int i = 0; i < 5; i++) {
+        TokenStream ts(program);
+        ts.tokenizeAll();
+
+        auto start = std::chrono::steady_clock::now();
+        auto ast = std::make_unique<AbstractSyntaxTree>(Parser(ts).parseProgram());
+        std::chrono::duration<double> parse = std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        ast.reset();
+        std::chrono::duration<double> destroy = std::chrono::steady_clock::now() - start;
+
+        parseSeconds = std::min(parseSeconds, parse.count());
+        destroySeconds = std::min(destroySeconds, destroy.count());
+    }
+
+    std::printf("parse    %8.3f s\n", parseSeconds);
+    std::printf("destroy  %8.3f s\n", destroySeconds);
+    std::printf("peak RSS %8.1f MB (+%.1f MB while parsing)\n", peakRSS() / 1024.0,
+                (peakRSS() - rssBefore) / 1024.0);
+}
+
+// One function returning a single expression of the given number of terms, cycling through all
+// precedence levels so that the parser has to climb up and down constantly.
+static std::string generateExpression(size_t terms) {
+    const char* ops[] = {" + ", " * ", " - ", " / ", " << ", " & ", " == ", " % ",
+                         " | ", " < ", " ^ ", " && ", " >> ", " || ", " != ", " >= "};
+
+    std::string program = "f(a, b) {\n    auto x = 0;\n    x = a";
+    for (size_t i = 1; i < terms; i++) {
+        program += ops[i % std::size(ops)];
+        program += (i % 3 == 0) ? "(a - b)" : (i % 2 ? "b" : "17");
+    }
+    program += ";\n    return x;\n}\n";
+
+    return program;
+}
+
+// Time per term should stay flat as the expression grows
+BENCHMARK(expression_chain) {
+    for (size_t terms : {250000, 500000, 1000000}) {
+        std::string program = generateExpression(terms);
+
+        double seconds = bench::measure([&] {
+            TokenStream ts(program);
+            ts.tokenizeAll();
+            AbstractSyntaxTree ast = Parser(ts).parseProgram();
+        });
+
+        std::printf("%8zu terms %8.3f s  %6.1f ns/term\n", terms, seconds, seconds * 1e9 / terms);
+    }
+}
+
+// Programs nesting one construct depth times, to make sure neither parser nor code generation
+// recurse on nesting depth
+static std::string generateNesting(const char* construct, size_t depth) {
+    std::string open, close, innermost = "r = r + a;";
+    std::string kind = construct;
+
+    if (kind == "blocks") {
+        open = "{ ";
+        close = " }";
+    } else if (kind == "if/else") {
+        open = "if (a) { r = r + 1; } else ";
+    } else if (kind == "while") {
+        open = "while (a) ";
+        innermost = "{ a = a - r; }";
+    } else if (kind == "parentheses") {
+        open = "(a + ";
+        close = ")";
+        innermost = "r = 1;";
+    } else if (kind == "unary") {
+        open = "-~";
+    }
+
+    std::string program = "f(a) {\n    register r = 1;\n    ";
+    std::string body;
+    body.reserve(depth * (open.size() + close.size()) + innermost.size());
+
+    if (kind == "parentheses" || kind == "unary") {
+        body += "r = ";
+        for (size_t i = 0; i < depth; i++) body += open;
+        body += "a";
+        for (size_t i = 0; i < depth; i++) body += close;
+        body += ";";
+    } else {
+        for (size_t i = 0; i < depth; i++) body += open;
+        body += innermost;
+        for (size_t i = 0; i < depth; i++) body += close;
+    }
+
+    return program + body + "\n    return r;\n}\n";
+}
+
+BENCHMARK(deep_nesting) {
+    const size_t depth = 100000;
+
+    for (const char* construct : {"blocks", "if/else", "while", "parentheses", "unary"}) {
+        std::string program = generateNesting(construct, depth);
+        double parseSeconds = 1e30;
+        double codegenSeconds = 1e30;
+
+        for (int i = 0; i < 3; i++) {
+            TokenStream ts(program);
+            ts.tokenizeAll();
+
+            auto start = std::chrono::steady_clock::now();
+            AbstractSyntaxTree ast = Parser(ts).parseProgram();
+            std::chrono::duration<double> parse = std::chrono::steady_clock::now() - start;
+
+            llvm::LLVMContext ctx;
+            start = std::chrono::steady_clock::now();
+            auto module = createModule(ctx, "deep", ast);
+            std::chrono::duration<double> codegen = std::chrono::steady_clock::now() - start;
+
+            parseSeconds = std::min(parseSeconds, parse.count());
+            codegenSeconds = std::min(codegenSeconds, codegen.count());
+        }
+
+        std::printf("%-12s depth %zu: parse %7.3f s  codegen %7.3f s\n", construct, depth,
+                    parseSeconds, codegenSeconds);
+    }
+}
+
+// Speedup of parsing with parseProgramParallel() over one thread, lexing is not included
+BENCHMARK(parallel_parse) {
+    std::string program = bench::generateProgram(200000);
+    TokenStream ts(program);
+    ts.tokenizeAll();
+
+    // every run reads the tokens through a fresh stream covering all of them
+    size_t end = ts.splitFunctions(1).back();
+
+    double sequential = bench::measure([&] {
+        TokenStream range(ts, 0, end);
+        AbstractSyntaxTree ast = Parser(range).parseProgram();
+    });
+
+    std::printf("hardware threads: %u\n", std::thread::hardware_concurrency());
+    std::printf("%2u threads %8.3f s\n", 1u, sequential);
+
+    for (unsigned threads : {2u, 4u, 8u, 16u}) {
+        double seconds = bench::measure([&] {
+            TokenStream range(ts, 0, end);
+            AbstractSyntaxTree ast = Parser(range).parseProgramParallel(threads);
+        });
+
+        std::printf("%2u threads %8.3f s  speedup %.2fx\n", threads, seconds, sequential / seconds);
+    }
+}
+
+// One function with many locals in its top block, followed by many sibling blocks and one deep
+// chain of nested blocks, each declaring a local of its own
+static std::string generateScopes(size_t locals, size_t blocks) {
+    std::string program = "f(a) {\n";
+
+    for (size_t i = 0; i < locals; i++) {
+        program += "    auto v" + std::to_string(i) + " = a;\n";
+    }
+
+    for (size_t i = 0; i < blocks; i++) {
+        program += "    { auto t = v" + std::to_string(i % locals) + "; v0 = t; }\n";
+    }
+
+    for (size_t i = 0; i < blocks; i++) {
+        program += "{ auto n" + std::to_string(i) + " = v0; ";
+    }
+
+    program += std::string(blocks, '}');
+    program += "\n    return v0;\n}\n";
+    return program;
+}
+
+// Enter and leave should cost time proportional to the names declared in the scope, not to all
+// names declared so far
+BENCHMARK(symbol_table) {
+    const size_t locals = 100000;
+    const size_t blocks = 100000;
+
+    double tableSeconds = bench::measure([&] {
+        SymbolTable<size_t> table;
+        table.enterScope();
+
+        for (SymbolId symbol = 0; symbol < locals; symbol++) {
+            table.insert(symbol, symbol, false, false);
+        }
+
+        for (size_t i = 0; i < blocks; i++) {
+            table.enterScope();
+            table.insert(locals, i, false, false);
+            table.insert(i % locals, i, false, false);
+            table.leaveScope();
+        }
+
+        for (size_t i = 0; i < blocks; i++) {
+            table.enterScope();
+            table.insert(locals + i, i, false, false);
+        }
+
+        for (size_t i = 0; i < blocks; i++) {
+            table.leaveScope();
+        }
+
+        table.leaveScope();
+    });
+
+    std::printf("table    %zu locals, %zu blocks: %8.3f s\n", locals, blocks, tableSeconds);
+
+    std::string program = generateScopes(locals, blocks);
+    double parseSeconds = 1e30;
+    double codegenSeconds = 1e30;
+
+    for (int i = 0; i < 3; i++) {
+        TokenStream ts(program);
+        ts.tokenizeAll();
+
+        auto start = std::chrono::steady_clock::now();
+        AbstractSyntaxTree ast = Parser(ts).parseProgram();
+        std::chrono::duration<double> parse = std::chrono::steady_clock::now() - start;
+
+        llvm::LLVMContext ctx;
+        start = std::chrono::steady_clock::now();
+        auto module = createModule(ctx, "scopes", ast);
+        std::chrono::duration<double> codegen = std::chrono::steady_clock::now() - start;
+
+        parseSeconds = std::min(parseSeconds, parse.count());
+        codegenSeconds = std::min(codegenSeconds, codegen.count());
+    }
+
+    std::printf("program  %zu locals, %zu blocks: parse %7.3f s  codegen %7.3f s\n", locals,
+                blocks, parseSeconds, codegenSeconds);
+}
+
+// Node memory of the parsed tree against its flat form, and the cost of flattening compared to
+// generating code from it
+BENCHMARK(flat_ast) {
+    std::string program = bench::generateProgram(200000);
+    TokenStream ts(program);
+    ts.tokenizeAll();
+    AbstractSyntaxTree ast = Parser(ts).parseProgram();
+
+    std::unique_ptr<FlatAST> flat;
+    double flattenSeconds = bench::measure([&] { flat = std::make_unique<FlatAST>(ast); });
+
+    double codegenSeconds = bench::measure([&] {
+        llvm::LLVMContext ctx;
+        auto module = createModule(ctx, "flat", *flat);
+    });
+
+    std::printf("tree     %8.1f MB\n", ast.memoryUsage() / (1024.0 * 1024.0));
+    std::printf("flat     %8.1f MB  %zu nodes\n", flat->memoryUsage() / (1024.0 * 1024.0),
+                flat->nodeCount());
+    std::printf("flatten  %8.3f s\n", flattenSeconds);
+    std::printf("codegen  %8.3f s\n", codegenSeconds);
+}
+
+// bench::generateProgram() with a different literal in every function, so that none can be
+// folded into another
+static std::string generateDistinctProgram(size_t functions) {
+    std::string identical = bench::generateProgram(functions);
+    std::string distinct;
+
+    size_t start = 0, found, function = 0;
+    while ((found = identical.find("result = 100;", start)) != std::string::npos) {
+        distinct.append(identical, start, found - start);
+        distinct += "result = " + std::to_string(function++) + ";";
+        start = found + std::strlen("result = 100;");
+    }
+    distinct.append(identical, start);
+
+    return distinct;
+}
+
+// Code generation of a program whose functions are all the same, which emits one body and
+// aliases, against one where each function differs in a literal and none can be folded
+BENCHMARK(identical_functions) {
+    std::string identical = bench::generateProgram(50000);
+    std::string distinct = generateDistinctProgram(50000);
+
+    for (const std::string* program : {&identical, &distinct}) {
+        TokenStream ts(*program);
+        ts.tokenizeAll();
+        FlatAST flat(Parser(ts).parseProgram());
+
+        double hashSeconds = bench::measure([&] { flat.findIdenticalFunctions(); });
+        double codegenSeconds = bench::measure([&] {
+            llvm::LLVMContext ctx;
+            auto module = createModule(ctx, "functions", flat);
+        });
+
+        std::printf("%-9s  hash %7.3f s  codegen %7.3f s\n",
+                    program == &identical ? "identical" : "distinct", hashSeconds, codegenSeconds);
+    }
+}
+
+// Code generation with and without simplifying the tree first, on functions with constant
+// subexpressions, identities, disabled debug code and an early return that is always taken.
+// The modules are verified, statements after a return must not end up in its block.
+BENCHMARK(simplify) {
+    std::string program;
+    for (size_t i = 0; i < 50000; i++) {
+        std::string number = std::to_string(i);
+        program += "func" + number + "(a, b) {\n";
+        program += "    register scaled = a * 8 + b * 1 + (" + number + " + 0);\n";
+        program += "    if (0) { scaled = check(scaled, " + number + "); }\n";
+        program += "    while (0 && scaled) { scaled = scaled - 1; }\n";
+        program += "    if ((1 > 2) < 5) { return scaled * 4 + 60 * 60 * 24; }\n";
+        program += "    scaled = 2;\n";
+        program += "    return scaled;\n";
+        program += "}\n";
+    }
+
+    for (bool simplify : {false, true}) {
+        TokenStream ts(program);
+        ts.tokenizeAll();
+        FlatAST flat(Parser(ts).parseProgram());
+
+        double simplifySeconds = simplify ? bench::measure([&] { flat.simplify(); }, 1) : 0;
+        size_t instructions = 0;
+        bool valid = true;
+        double codegenSeconds = bench::measure([&] {
+            llvm::LLVMContext ctx;
+            auto module = createModule(ctx, "simplify", flat);
+            instructions = module->getInstructionCount();
+            valid = !llvm::verifyModule(*module);
+        });
+
+        std::printf("%-10s  simplify %7.3f s  codegen %7.3f s  %zu instructions%s\n",
+                    simplify ? "simplified" : "as parsed", simplifySeconds, codegenSeconds,
+                    instructions, valid ? "" : "  INVALID MODULE");
+    }
+}
+
+// Memory of -l -f, which generates and prints one function at a time, against parsing the whole
+// program, generating the module and printing it. Streaming runs first, the peak RSS only grows.
+BENCHMARK(streaming_codegen) {
+    std::string program = generateDistinctProgram(200000);
+    std::ofstream sink("/dev/null");
+    long baseline = peakRSS();
+
+    double streamSeconds = bench::measure([&] {
+        TokenStream ts(program);
+        ts.tokenizeAll();
+        Parser parser(ts);
+        FunctionStreamer streamer("streamed", sink, ts.getSource(), ts.getInterner());
+
+        while (auto function = parser.parseNextFunction()) {
+            streamer.add(*function);
+            parser.releaseNodes();
+        }
+
+        streamer.finish();
+    }, 1);
+    long streamRSS = peakRSS();
+
+    double moduleSeconds = bench::measure([&] {
+        TokenStream ts(program);
+        ts.tokenizeAll();
+        FlatAST flat(Parser(ts).parseProgram());
+        flat.simplify();
+
+        llvm::LLVMContext ctx;
+        auto module = createModule(ctx, "module", flat);
+        llvm::raw_os_ostream out(sink);
+        module->print(out, nullptr);
+    }, 1);
+    long moduleRSS = peakRSS();
+
+    std::printf("streamed  %7.3f s  peak RSS +%6.1f MB\n", streamSeconds,
+                (streamRSS - baseline) / 1024.0);
+    std::printf("module    %7.3f s  peak RSS +%6.1f MB\n", moduleSeconds,
+                (moduleRSS - baseline) / 1024.0);
+}
+
+// Code generation for all functions of a helper library against only those reachable from main,
+// which calls every hundredth of them
+BENCHMARK(dead_functions) {
+    std::string program = generateDistinctProgram(100000);
+    program += "main() {\n    auto sum = 0;\n";
+    for (size_t i = 0; i < 100000; i += 100) {
+        program += "    sum = sum + func" + std::to_string(i) + "(sum, 1);\n";
+    }
+    program += "    return sum;\n}\n";
+
+    TokenStream ts(program);
+    ts.tokenizeAll();
+    FlatAST flat(Parser(ts).parseProgram());
+    flat.simplify();
+
+    std::vector<std::string> roots = {"main"};
+    size_t allFunctions = 0, reachableFunctions = 0;
+
+    double reachabilitySeconds = bench::measure([&] { flat.findReachableFunctions(roots); });
+    double allSeconds = bench::measure([&] {
+        llvm::LLVMContext ctx;
+        allFunctions = createModule(ctx, "all", flat)->getFunctionList().size();
+    });
+    double reachableSeconds = bench::measure([&] {
+        llvm::LLVMContext ctx;
+        reachableFunctions = createModule(ctx, "reachable", flat, roots)->getFunctionList().size();
+    });
+
+    std::printf("reachability  %7.3f s\n", reachabilitySeconds);
+    std::printf("all           %7.3f s  %zu functions\n", allSeconds, allFunctions);
+    std::printf("from main     %7.3f s  %zu functions  speedup %.1fx\n", reachableSeconds,
+                reachableFunctions, allSeconds / reachableSeconds);
+}
+
+// Code generation with and without inlining, on functions that use small accessors. Inlining
+// trades the calls for the instructions of the accessors.
+BENCHMARK(inlining) {
+    std::string program =
+        "get(a, i) { return a[i]; }\n"
+        "add(a, b) { return a + b; }\n"
+        "scale(x, k) { return x * k; }\n"
+        "within(lo, x, hi) { return lo <= x && x < hi; }\n";
+    for (size_t i = 0; i < 50000; i++) {
+        std::string number = std::to_string(i);
+        program += "func" + number + "(a, b) {\n";
+        program += "    register sum = add(get(a, b), scale(b, " + number + "));\n";
+        program += "    if (within(0, b, " + number + ")) { sum = add(sum, get(a, 1)); }\n";
+        program += "    return sum;\n";
+        program += "}\n";
+    }
+
+    for (bool inlined : {false, true}) {
+        TokenStream ts(program);
+        ts.tokenizeAll();
+        FlatAST flat(Parser(ts).parseProgram());
+
+        double inlineSeconds = inlined ? bench::measure([&] { flat.inlineCalls(); }, 1) : 0;
+        flat.simplify();
+
+        size_t instructions = 0, calls = 0;
+        double codegenSeconds = bench::measure([&] {
+            llvm::LLVMContext ctx;
+            auto module = createModule(ctx, "inlining", flat);
+            instructions = module->getInstructionCount();
+
+            calls = 0;
+            for (const llvm::Function& function : *module) {
+                for (const llvm::BasicBlock& block : function) {
+                    calls += std::count_if(block.begin(), block.end(), [](auto& instruction) {
+                        return llvm::isa<llvm::CallInst>(instruction);
+                    });
+                }
+            }
+        });
+
+        std::printf("%-7s  inline %7.3f s  codegen %7.3f s  %zu instructions  %zu calls\n",
+                    inlined ? "inlined" : "calls", inlineSeconds, codegenSeconds, instructions,
+                    calls);
+    }
+}
+
+// Frontend time against loading the tree from a cache file, which has to validate every node
+BENCHMARK(ast_cache) {
+    std::string program = bench::generateProgram(200000);
+    std::filesystem::path cachePath =
+        std::filesystem::temp_directory_path() / "clonk-bench.astcache";
+
+    double parseSeconds = bench::measure([&] {
+        TokenStream ts(program);
+        ts.tokenizeAll();
+        FlatAST flat(Parser(ts).parseProgram());
+    });
+
+    TokenStream ts(program);
+    ts.tokenizeAll();
+    FlatAST flat(Parser(ts).parseProgram());
+
+    double storeSeconds = bench::measure([&] { ASTCache::store(cachePath, program, flat); });
+    double loadSeconds = bench::measure([&] { ASTCache::load(cachePath, program); });
+
+    std::printf("lex+parse %7.3f s\n", parseSeconds);
+    std::printf("store     %7.3f s  (%.1f MB)\n", storeSeconds,
+                std::filesystem::file_size(cachePath) / (1024.0 * 1024.0));
+    std::printf("load      %7.3f s  speedup %.1fx\n", loadSeconds, parseSeconds / loadSeconds);
+
+    std::filesystem::remove(cachePath);
+}
+
+// -a output of a deeply nested expression: to_string() copies the text of every subtree into its
+// parent and recurses, ASTPrinter writes each node once. to_string() only runs on the smaller
+// depths, deeper trees would overflow its stack
+BENCHMARK(ast_printer) {
+    for (size_t depth : {1000, 2000, 4000, 8000, 1000000}) {
+        std::string program = generateNesting("parentheses", depth);
+        TokenStream ts(program);
+        ts.tokenizeAll();
+        AbstractSyntaxTree ast = Parser(ts).parseProgram();
+
+        size_t bytes = 0;
+        double printerSeconds = bench::measure([&] {
+            std::ostringstream out;
+            ASTPrinter(out).print(ast);
+            bytes = out.view().size();
+        });
+
+        std::printf("depth %8zu: printer %8.4f s", depth, printerSeconds);
+
+        if (depth <= 8000) {
+            double toStringSeconds = bench::measure([&] {
+                std::ostringstream out;
+                for (const Function* function : ast.getFunctions()) {
+                    out << function->to_string() << std::endl;
+                }
+            });
+
+            std::printf("  to_string %8.4f s", toStringSeconds);
+        }
+
+        std::printf("  (%zu KB)\n", bytes / 1024);
+    }
+}
+
+// A one-line edit in the middle of programs of growing size, parsed from scratch and reparsed.
+// Reparsing should take about the same time for every size.
+BENCHMARK(reparse) {
+    for (size_t functions : {20000, 200000}) {
+        std::string program = bench::generateProgram(functions);
+        size_t offset = program.find("result = 100;", program.size() / 2);
+
+        std::string edited = program;
+        edited.replace(offset, 13, "result = 1000;");
+
+        auto original = SourceBuffer::fromString(program);
+        auto changed = SourceBuffer::fromString(edited);
+
+        double parseSeconds = bench::measure([&] {
+            TokenStream ts(changed);
+            ts.tokenizeAll();
+            AbstractSyntaxTree ast = Parser(ts).parseProgram();
+        });
+
+        TokenStream ts(original);
+        ts.tokenizeAll();
+        AbstractSyntaxTree ast = Parser(ts).parseProgram();
+
+        // edits back and forth, every run reparses the tree of the one before
+        bool toEdited = true;
+        double reparseSeconds = bench::measure([&] {
+            TextEdit edit = {offset, offset + (toEdited ? 13 : 14), offset + (toEdited ? 14 : 13)};
+            ast = Parser::reparse(std::move(ast), toEdited ? changed : original, edit);
+            toEdited = !toEdited;
+        });
+
+        std::printf("%7zu functions: parse %8.3f s  reparse %8.5f s  speedup %.0fx\n", functions,
+                    parseSeconds, reparseSeconds, parseSeconds / reparseSeconds);
+    }
+}
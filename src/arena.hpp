@@ -0,0 +1,96 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace clonk {
+
+/**
+ * Bump pointer allocator for AST nodes. Objects are placed contiguously in chunks and are
+ * released all at once when the arena is destroyed or reset, destructors are never run.
+ * Chunks double in size up to maxChunkSize, so small programs stay small.
+ */
+class Arena {
+    static constexpr size_t initialChunkSize = 1 << 16;
+    static constexpr size_t maxChunkSize = 1 << 24;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t nextChunkSize = initialChunkSize;
+    size_t used = 0;  // bytes handed out, including alignment padding
+    uintptr_t current = 0;
+    uintptr_t end = 0;
+
+    void* allocate(size_t size, size_t alignment) {
+        uintptr_t aligned = (current + alignment - 1) & ~(alignment - 1);
+
+        if (aligned + size > end) {
+            size_t chunkSize = std::max(nextChunkSize, size + alignment);
+            chunks.push_back(std::make_unique<char[]>(chunkSize));
+            nextChunkSize = std::min(nextChunkSize * 2, maxChunkSize);
+
+            current = reinterpret_cast<uintptr_t>(chunks.back().get());
+            end = current + chunkSize;
+            aligned = (current + alignment - 1) & ~(alignment - 1);
+        }
+
+        used += aligned + size - current;
+        current = aligned + size;
+        return reinterpret_cast<void*>(aligned);
+    }
+
+   public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>,
+                      "arena memory is released without running destructors");
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Copies values into the arena, the span stays valid as long as the arena
+    template <typename T>
+    std::span<const T> copy(std::span<const T> values) {
+        static_assert(std::is_trivially_destructible_v<T>,
+                      "arena memory is released without running destructors");
+
+        if (values.empty()) {
+            return {};
+        }
+
+        T* data = static_cast<T*>(allocate(sizeof(T) * values.size(), alignof(T)));
+        std::uninitialized_copy(values.begin(), values.end(), data);
+        return {data, values.size()};
+    }
+
+    template <typename T>
+    std::span<const T> copy(const std::vector<T>& values) {
+        return copy(std::span<const T>(values));
+    }
+
+    // Releases everything allocated so far, keeps the most recent chunk for reuse
+    void reset() {
+        if (chunks.size() > 1) {
+            chunks.erase(chunks.begin(), chunks.end() - 1);
+        }
+
+        if (!chunks.empty()) {
+            current = reinterpret_cast<uintptr_t>(chunks.back().get());
+        }
+
+        used = 0;
+    }
+
+    size_t bytesUsed() const { return used; }
+};
+
+}  // end namespace clonk
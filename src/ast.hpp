@@ -4,13 +4,16 @@
 #include <cstdint>
 #include <memory>
 #include <optional>
+#include <span>
 #include <sstream>
-#include <stack>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
+#include "arena.hpp"
+#include "interner.hpp"
 #include "lexer.hpp"
+#include "source.hpp"
 
 namespace clonk {
 
@@ -18,104 +21,157 @@ template <typename T>
 struct ScopedSymbol {
     unsigned scopeDepth;
     T value;
-    std::string_view name;
     bool isRegister;
     bool isFunctionParam;
 
-    ScopedSymbol(unsigned scopeDepth, T value, std::string_view ident, bool isRegister = false,
+    ScopedSymbol(unsigned scopeDepth, T value, bool isRegister = false,
                  bool isFunctionParam = false)
         : scopeDepth(isFunctionParam
                          ? scopeDepth + 1
                          : scopeDepth),  // no shadowing of function parameters in top block
           value(value),
-          name(ident),
           isRegister(isRegister),
           isFunctionParam(isFunctionParam) {}
 };
 
+/**
+ * Scoped declarations, indexed by SymbolId. Only the innermost declaration of a name is stored,
+ * declaring a name again shadows the old declaration in place and records it in an undo log.
+ * Leaving a scope restores the shadowed declarations from the log, so entering and leaving a
+ * scope costs time proportional to the names declared in it.
+ */
 template <typename T>
 class SymbolTable {
-    std::unordered_map<std::string_view, std::stack<ScopedSymbol<T>>> symbols;
+    struct Shadowed {
+        SymbolId symbol;
+        std::optional<ScopedSymbol<T>> declaration;
+    };
+
+    std::vector<std::optional<ScopedSymbol<T>>> visible;  // innermost declaration
+    std::vector<Shadowed> undoLog;                         // one entry per insert
     unsigned currentDepth = 0;
 
    public:
-    std::optional<ScopedSymbol<T>> get(std::string_view name) {
-        auto stack = symbols[name];
-        if (stack.empty()) {
-            return std::nullopt;
+    // Innermost declaration of symbol, nullptr if undeclared. Valid until the next insert.
+    const ScopedSymbol<T>* get(SymbolId symbol) const {
+        if (symbol >= visible.size() || !visible[symbol]) {
+            return nullptr;
         }
 
-        return stack.top();
+        return &*visible[symbol];
     }
 
-    std::string insert(std::string_view name, T value, bool isRegister, bool isFunctionParam) {
-        auto& stack = symbols[name];
+    // Returns false if the symbol is already declared in the current scope
+    bool insert(SymbolId symbol, T value, bool isRegister, bool isFunctionParam) {
+        if (symbol >= visible.size()) {
+            visible.resize(symbol + 1);
+        }
 
-        if (!stack.empty()) {
-            auto scope = stack.top();
+        std::optional<ScopedSymbol<T>>& declaration = visible[symbol];
 
-            if (!scope.isRegister && scope.scopeDepth >= currentDepth) {
-                return "";
-            }
+        if (declaration && !declaration->isRegister && declaration->scopeDepth >= currentDepth) {
+            return false;
         }
 
-        symbols[name].push(ScopedSymbol<T>(currentDepth, value, name, isRegister, isFunctionParam));
-        return std::string(name);
+        undoLog.push_back({symbol, declaration});
+        declaration.emplace(currentDepth, value, isRegister, isFunctionParam);
+        return true;
     }
 
     void enterScope() { currentDepth++; }
 
+    // Declarations are logged in scope order, the ones of this scope are at the end of the log.
+    // Function parameters are declared before their scope is entered, with its depth.
     void leaveScope() {
-        for (auto& e : symbols) {
-            if (e.second.empty())
-                continue;
-
-            if (e.second.top().scopeDepth >= currentDepth) {
-                e.second.pop();
-            }
+        while (!undoLog.empty() && visible[undoLog.back().symbol]->scopeDepth >= currentDepth) {
+            Shadowed& shadowed = undoLog.back();
+            visible[shadowed.symbol] = std::move(shadowed.declaration);
+            undoLog.pop_back();
         }
 
         currentDepth--;
     }
 };
 
+// Concrete node types, used for dispatch without RTTI. Expressions come first with the lvalues
+// in front, so the abstract node types are contiguous ranges.
+enum class NodeKind : uint8_t {
+    Identifier,
+    IndexExpr,
+    IntLiteral,
+    BinOp,
+    UnOp,
+    FunctionCall,
+
+    Declaration,
+    WhileStatement,
+    IfStatement,
+    ExprStatement,
+    ReturnStatement,
+    Block,
+};
+
+// Nodes are allocated in the Arena of their AbstractSyntaxTree and never deleted individually.
+// Every node type has a classof(), so llvm::isa and llvm::dyn_cast work on nodes.
 struct ASTNode {
+    const NodeKind kind;
+
     virtual std::string to_string() const = 0;
-    virtual ~ASTNode() = default;
+
+   protected:
+    explicit ASTNode(NodeKind kind) : kind(kind) {}
+    ~ASTNode() = default;
 };
 
-struct Expression : public ASTNode {};
+struct Expression : public ASTNode {
+    static bool classof(const ASTNode* node) { return node->kind <= NodeKind::FunctionCall; }
 
-struct LValue : public Expression {};
+   protected:
+    using ASTNode::ASTNode;
+};
 
-static unsigned idIndex = 1;
+struct LValue : public Expression {
+    static bool classof(const ASTNode* node) { return node->kind <= NodeKind::IndexExpr; }
+
+   protected:
+    using Expression::Expression;
+};
 
 struct Identifier : LValue {
-    std::string name;
-    const unsigned id;
+    std::string_view name;  // owned by the StringInterner
+    SymbolId symbol;
+
+    // Number of the variable within its function, set by the parser: parameters come first,
+    // then every declaration in order. References share the slot of their declaration.
+    uint32_t slot = 0;
 
-    Identifier(const std::string& name) : name(name), id(idIndex++) {}
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::Identifier; }
 
-    std::string to_string() const override { return name; }
+    Identifier(Symbol symbol)
+        : LValue(NodeKind::Identifier), name(symbol.name), symbol(symbol.id) {}
 
-    bool operator==(const Identifier& other) { return other.id == this->id; }
+    std::string to_string() const override { return std::string(name); }
 };
 
 struct IntLiteral : Expression {
     uint64_t value;
 
-    IntLiteral(uint64_t value) : value(value) {}
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::IntLiteral; }
+
+    IntLiteral(uint64_t value) : Expression(NodeKind::IntLiteral), value(value) {}
 
     std::string to_string() const override { return std::to_string(value); }
 };
 
 struct BinOp : Expression {
     TokenType op;
-    std::unique_ptr<Expression> leftExpr;
-    std::unique_ptr<Expression> rightExpr;
+    Expression* leftExpr;
+    Expression* rightExpr;
+
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::BinOp; }
 
-    BinOp(std::unique_ptr<Expression> left, std::unique_ptr<Expression> right, TokenType op)
-        : op(op), leftExpr(std::move(left)), rightExpr(std::move(right)) {}
+    BinOp(Expression* left, Expression* right, TokenType op)
+        : Expression(NodeKind::BinOp), op(op), leftExpr(left), rightExpr(right) {}
 
     std::string to_string() const override {
         return "(" + opToString(op) + " " + leftExpr->to_string() + " " + rightExpr->to_string() +
@@ -125,9 +181,11 @@ struct BinOp : Expression {
 
 struct UnOp : Expression {
     TokenType op;
-    std::unique_ptr<Expression> expr;
+    Expression* expr;
+
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::UnOp; }
 
-    UnOp(std::unique_ptr<Expression> expr, TokenType op) : op(op), expr(std::move(expr)) {}
+    UnOp(Expression* expr, TokenType op) : Expression(NodeKind::UnOp), op(op), expr(expr) {}
 
     std::string to_string() const override {
         return "(" + opToString(op) + " " + expr->to_string() + ")";
@@ -135,11 +193,13 @@ struct UnOp : Expression {
 };
 
 struct FunctionCall : Expression {
-    std::unique_ptr<Identifier> ident;
-    std::vector<std::unique_ptr<Expression>> paramList;
+    Identifier* ident;
+    std::span<Expression* const> paramList;
 
-    FunctionCall(std::unique_ptr<Identifier> ident, std::vector<std::unique_ptr<Expression>> params)
-        : ident(std::move(ident)), paramList(std::move(params)) {}
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::FunctionCall; }
+
+    FunctionCall(Identifier* ident, std::span<Expression* const> params)
+        : Expression(NodeKind::FunctionCall), ident(ident), paramList(params) {}
 
     std::string to_string() const override {
         std::ostringstream ss;
@@ -153,12 +213,14 @@ struct FunctionCall : Expression {
 };
 
 struct IndexExpr : LValue {
-    std::unique_ptr<Expression> array;
-    std::unique_ptr<Expression> idx;
+    Expression* array;
+    Expression* idx;
     int sizeSpec;
 
-    IndexExpr(std::unique_ptr<Expression> array, std::unique_ptr<Expression> idx, int sizeSpec = 8)
-        : array(std::move(array)), idx(std::move(idx)), sizeSpec(sizeSpec) {}
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::IndexExpr; }
+
+    IndexExpr(Expression* array, Expression* idx, int sizeSpec = 8)
+        : LValue(NodeKind::IndexExpr), array(array), idx(idx), sizeSpec(sizeSpec) {}
 
     std::string to_string() const override {
         return "([] " + array->to_string() + " " + idx->to_string() + "@" +
@@ -166,17 +228,27 @@ struct IndexExpr : LValue {
     }
 };
 
-struct Statement : ASTNode {};
+struct Statement : ASTNode {
+    static bool classof(const ASTNode* node) { return node->kind >= NodeKind::Declaration; }
+
+   protected:
+    using ASTNode::ASTNode;
+};
 
 struct Declaration : Statement {
     bool isAuto;
     bool isRegister;
-    std::unique_ptr<Identifier> ident;
-    std::unique_ptr<Expression> expr;
+    Identifier* ident;
+    Expression* expr;
 
-    Declaration(bool isAuto, bool isRegister, std::unique_ptr<Identifier> ident,
-                std::unique_ptr<Expression> expr)
-        : isAuto(isAuto), isRegister(isRegister), ident(std::move(ident)), expr(std::move(expr)) {}
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::Declaration; }
+
+    Declaration(bool isAuto, bool isRegister, Identifier* ident, Expression* expr)
+        : Statement(NodeKind::Declaration),
+          isAuto(isAuto),
+          isRegister(isRegister),
+          ident(ident),
+          expr(expr) {}
 
     std::string to_string() const override {
         return "(decl " + ident->to_string() + " " + (expr ? expr->to_string() + ")" : "()") + "\n";
@@ -184,11 +256,13 @@ struct Declaration : Statement {
 };
 
 struct WhileStatement : Statement {
-    std::unique_ptr<Expression> condition;
-    std::unique_ptr<Statement> statement;
+    Expression* condition;
+    Statement* statement;
+
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::WhileStatement; }
 
-    WhileStatement(std::unique_ptr<Expression> condition, std::unique_ptr<Statement> statement)
-        : condition(std::move(condition)), statement(std::move(statement)) {}
+    WhileStatement(Expression* condition, Statement* statement)
+        : Statement(NodeKind::WhileStatement), condition(condition), statement(statement) {}
 
     std::string to_string() const override {
         return "(while " + condition->to_string() + " " + statement->to_string() + ")\n";
@@ -196,20 +270,23 @@ struct WhileStatement : Statement {
 };
 
 struct IfStatement : Statement {
-    std::unique_ptr<Expression> condition;
-    std::unique_ptr<Statement> statement;
-    std::optional<std::unique_ptr<Statement>> elseStatement;
+    Expression* condition;
+    Statement* statement;
+    std::optional<Statement*> elseStatement;
 
-    IfStatement(std::unique_ptr<Expression> condition, std::unique_ptr<Statement> statement)
-        : condition(std::move(condition)),
-          statement(std::move(statement)),
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::IfStatement; }
+
+    IfStatement(Expression* condition, Statement* statement)
+        : Statement(NodeKind::IfStatement),
+          condition(condition),
+          statement(statement),
           elseStatement(std::nullopt) {}
 
-    IfStatement(std::unique_ptr<Expression> condition, std::unique_ptr<Statement> statement,
-                std::unique_ptr<Statement> elseStatement)
-        : condition(std::move(condition)),
-          statement(std::move(statement)),
-          elseStatement(std::move(elseStatement)) {}
+    IfStatement(Expression* condition, Statement* statement, Statement* elseStatement)
+        : Statement(NodeKind::IfStatement),
+          condition(condition),
+          statement(statement),
+          elseStatement(elseStatement) {}
 
     std::string to_string() const override {
         std::string result = "(if " + condition->to_string() + " " + statement->to_string();
@@ -222,9 +299,11 @@ struct IfStatement : Statement {
 };
 
 struct ExprStatement : Statement {
-    std::unique_ptr<Expression> expr;
+    Expression* expr;
+
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::ExprStatement; }
 
-    ExprStatement(std::unique_ptr<Expression> expr) : expr(std::move(expr)) {}
+    ExprStatement(Expression* expr) : Statement(NodeKind::ExprStatement), expr(expr) {}
 
     std::string to_string() const override {
         return "(expr statement " + expr->to_string() + ")\n";
@@ -232,11 +311,13 @@ struct ExprStatement : Statement {
 };
 
 struct ReturnStatement : Statement {
-    std::optional<std::unique_ptr<Expression>> expr;
+    std::optional<Expression*> expr;
+
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::ReturnStatement; }
 
-    ReturnStatement() : expr(std::nullopt) {}
+    ReturnStatement() : Statement(NodeKind::ReturnStatement), expr(std::nullopt) {}
 
-    ReturnStatement(std::unique_ptr<Expression> expr) : expr(std::move(expr)) {}
+    ReturnStatement(Expression* expr) : Statement(NodeKind::ReturnStatement), expr(expr) {}
 
     std::string to_string() const override {
         return "(return " + (expr ? expr.value()->to_string() : "()") + ")\n";
@@ -244,9 +325,12 @@ struct ReturnStatement : Statement {
 };
 
 struct Block : Statement {
-    const std::vector<std::unique_ptr<Statement>> statements;
+    const std::span<Statement* const> statements;
 
-    Block(std::vector<std::unique_ptr<Statement>> statements) : statements(std::move(statements)) {}
+    static bool classof(const ASTNode* node) { return node->kind == NodeKind::Block; }
+
+    Block(std::span<Statement* const> statements)
+        : Statement(NodeKind::Block), statements(statements) {}
 
     std::string to_string() const override {
         std::string result = "(block \n";
@@ -258,15 +342,31 @@ struct Block : Statement {
     }
 };
 
-struct Function {
-    const std::unique_ptr<Identifier> ident;
-    const std::vector<std::unique_ptr<Identifier>> params;
-    const std::unique_ptr<Block> block;
-    std::vector<std::string_view> autoDecls;
+// A call of a function, or its definition, with the number of parameters
+struct ParamCountUse {
+    SymbolId function;
+    uint32_t paramCount;
+};
 
-    Function(std::unique_ptr<Identifier> ident, std::vector<std::unique_ptr<Identifier>> params,
-             std::unique_ptr<Block> block, std::vector<std::string_view> autoDecls)
-        : ident(std::move(ident)), params(std::move(params)), block(std::move(block)), autoDecls(autoDecls) {}
+struct Function {
+    Identifier* const ident;
+    const std::span<Identifier* const> params;
+    Block* const block;
+    std::span<const Identifier* const> autoDecls;
+    uint32_t slotCount;  // variables of the function, see Identifier::slot
+
+    // calls in the body and then the definition itself, in the order the parser checked them
+    std::span<const ParamCountUse> paramCountUses;
+
+    Function(Identifier* ident, std::span<Identifier* const> params, Block* block,
+             std::span<const Identifier* const> autoDecls, uint32_t slotCount,
+             std::span<const ParamCountUse> paramCountUses)
+        : ident(ident),
+          params(params),
+          block(block),
+          autoDecls(autoDecls),
+          slotCount(slotCount),
+          paramCountUses(paramCountUses) {}
 
     std::string to_string() const {
         std::ostringstream ss;
@@ -279,16 +379,45 @@ struct Function {
     }
 };
 
+// Where a function definition was parsed from
+struct FunctionSource {
+    size_t begin = 0;      // offset of the name
+    size_t end = 0;        // past the closing brace
+    size_t nodeBytes = 0;  // arena memory taken by the nodes of the function
+};
+
+// Calls and definitions of a function name across a program, which all agree on the number of
+// parameters
+struct ParamCountTally {
+    uint32_t paramCount = 0;
+    uint32_t uses = 0;  // calls and definitions
+    uint32_t definitions = 0;
+};
+
 class Parser;
 
 class AbstractSyntaxTree {
-    std::vector<std::unique_ptr<Function>> functions;
+    // own all nodes, one per parser thread and one per reparse
+    std::vector<std::unique_ptr<Arena>> arenas;
+    std::vector<Function*> functions;
+    std::vector<FunctionSource> functionSources;  // parallel to functions
     std::vector<std::pair<std::string, int>> externFunctions;  // name, paramcount
 
+    // indexed by SymbolId, and the arena memory of the nodes of all functions. Kept up to date
+    // by Parser::reparse(), which counts them on its first run.
+    std::vector<ParamCountTally> paramCountTallies;
+    size_t liveNodeBytes = 0;
+
+    // program text the nodes were parsed from and the identifier names, kept alive as long as
+    // the tree. Reparsing interns the names of the edited text into the same interner.
+    std::shared_ptr<const SourceBuffer> source;
+    std::shared_ptr<StringInterner> interner;
+
     friend Parser;
 
-    void addFunction(std::unique_ptr<Function> function) {
-        functions.push_back(std::move(function));
+    void addFunction(Function* function, const FunctionSource& functionSource) {
+        functions.push_back(function);
+        functionSources.push_back(functionSource);
     }
 
     void addExternFunction(std::string name, int paramCount) {
@@ -304,16 +433,24 @@ class AbstractSyntaxTree {
         return ss.str();
     }
 
-    const std::vector<std::unique_ptr<Function>>& getFunctions() const { return functions; }
+    const std::vector<Function*>& getFunctions() const { return functions; }
 
     const std::vector<std::pair<std::string, int>>& getExternFunctions() const {
         return externFunctions;
     }
-};
 
-}  // end namespace clonk
+    const std::shared_ptr<const SourceBuffer>& getSource() const { return source; }
 
-template <>
-struct std::hash<clonk::Identifier> {
-    std::size_t operator()(const clonk::Identifier& ident) const noexcept { return ident.id; }
+    std::shared_ptr<const StringInterner> getInterner() const { return interner; }
+
+    // bytes allocated for nodes
+    size_t memoryUsage() const {
+        size_t bytes = 0;
+        for (const auto& arena : arenas) {
+            bytes += arena->bytesUsed();
+        }
+        return bytes;
+    }
 };
+
+}  // end namespace clonk
@@ -0,0 +1,449 @@
+#include "ast_cache.hpp"
+#include <unistd.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "ast.hpp"
+#include "source.hpp"
+
+using namespace clonk;
+
+namespace {
+
+constexpr char magic[8] = {'C', 'L', 'O', 'N', 'K', 'A', 'S', 'T'};
+
+// bump whenever FlatNode, FlatFunction or what the parser produces changes
+constexpr uint32_t formatVersion = 3;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t nodeSize;  // sizeof(FlatNode), in case the layout changes without a version bump
+    uint64_t sourceSize;
+    uint64_t sourceHash;
+    uint64_t payloadHash;  // of everything after the header, a damaged file is not read
+
+    uint64_t nodeCount;
+    uint64_t literalCount;
+    uint64_t listCount;
+    uint64_t functionCount;
+    uint64_t nameCount;
+    uint64_t nameBytes;
+    uint64_t externCount;
+    uint64_t externBytes;
+};
+
+/**
+ * Offsets of the sections following the header, each starts 8 byte aligned:
+ *
+ *   FlatNode     nodes[nodeCount]
+ *   uint64_t     literals[literalCount]
+ *   uint32_t     lists[listCount]
+ *   FlatFunction functions[functionCount]
+ *   uint32_t     nameOffsets[nameCount + 1]
+ *   char         names[nameBytes]
+ *   uint32_t     externs[2 * externCount]     param count and name length
+ *   char         externNames[externBytes]
+ */
+struct Layout {
+    size_t nodes, literals, lists, functions, nameOffsets, names, externs, externNames, end;
+
+    explicit Layout(const Header& header) {
+        size_t offset = sizeof(Header);
+
+        auto section = [&](size_t bytes) {
+            size_t start = (offset + 7) & ~size_t(7);
+            offset = start + bytes;
+            return start;
+        };
+
+        nodes = section(header.nodeCount * sizeof(FlatNode));
+        literals = section(header.literalCount * sizeof(uint64_t));
+        lists = section(header.listCount * sizeof(uint32_t));
+        functions = section(header.functionCount * sizeof(FlatFunction));
+        nameOffsets = section((header.nameCount + 1) * sizeof(uint32_t));
+        names = section(header.nameBytes);
+        externs = section(header.externCount * 2 * sizeof(uint32_t));
+        externNames = section(header.externBytes);
+        end = offset;
+    }
+};
+
+template <typename T>
+std::span<const T> section(std::string_view data, size_t offset, size_t count) {
+    return {reinterpret_cast<const T*>(data.data() + offset), count};
+}
+
+uint64_t hashText(std::string_view text) {
+    uint64_t h = 0x9E3779B97F4A7C15 ^ text.size();
+    size_t i = 0;
+
+    for (; i + 8 <= text.size(); i += 8) {
+        uint64_t word;
+        std::memcpy(&word, text.data() + i, sizeof(word));
+        h = (h ^ word) * 0xBF58476D1CE4E5B9;
+        h ^= h >> 31;
+    }
+
+    uint64_t tail = 0;
+    std::memcpy(&tail, text.data() + i, text.size() - i);
+    h = (h ^ tail) * 0x94D049BB133111EB;
+    return h ^ (h >> 29);
+}
+
+bool isBinaryOp(uint8_t op) {
+    switch (op) {
+        case OpPlus:
+        case OpMinus:
+        case OpMultiply:
+        case OpDivide:
+        case OpModulo:
+        case OpAmp:
+        case OpOr:
+        case OpXor:
+        case OpShiftLeft:
+        case OpShiftRight:
+        case OpLogicalOr:
+        case OpLogicalAnd:
+        case OpGreaterThan:
+        case OpLessThan:
+        case OpGreaterEq:
+        case OpLessEq:
+        case OpEquals:
+        case OpNotEquals:
+        case OpAssign: return true;
+        default: return false;
+    }
+}
+
+bool isUnaryOp(uint8_t op) {
+    return op == OpMinus || op == OpNot || op == OpBitNot || op == OpAmp;
+}
+
+// The fields a kind does not use keep the defaults of FlatNode, later passes read some of them
+// without looking at the kind
+bool hasDefaultUnused(const FlatNode& node) {
+    bool noData = node.data == 0;
+    bool noRhs = node.rhs == noNode;
+    bool noExtra = node.extra == 0;
+    if (node.unused != 0) {
+        return false;
+    }
+
+    switch (node.kind) {
+        case NodeKind::Identifier: return noData && noRhs;
+        case NodeKind::BinOp:
+        case NodeKind::IndexExpr: return noExtra;
+        case NodeKind::UnOp: return noRhs && noExtra;
+        case NodeKind::Declaration: return true;
+        case NodeKind::FunctionCall:
+        case NodeKind::IfStatement: return noData;
+        case NodeKind::WhileStatement: return noData && noExtra;
+        case NodeKind::IntLiteral:
+        case NodeKind::ExprStatement:
+        case NodeKind::ReturnStatement: return noData && noRhs && noExtra;
+        case NodeKind::Block: return noData && node.lhs == noNode;
+    }
+    return false;
+}
+
+// Every index in the tree is in bounds, children come after their parent within the nodes of
+// the same function and variable slots are below the slot count of that function. Walking a
+// damaged file can then neither read out of bounds nor loop. Nodes also hold what the parser
+// produces: known operators and size specs, expressions and statements where they belong,
+// variables to assign or take the address of, and auto declarations of the auto variables.
+bool isValid(std::span<const FlatNode> nodes, size_t literalCount,
+             std::span<const uint32_t> lists, std::span<const FlatFunction> functions,
+             size_t nameCount) {
+    auto isList = [&](uint32_t first, uint32_t count) {
+        return first <= lists.size() && count <= lists.size() - first;
+    };
+
+    // functions are laid out one after the other, each up to the body of the next
+    for (size_t f = 0; f < functions.size(); f++) {
+        const FlatFunction& function = functions[f];
+        NodeIndex end = f + 1 < functions.size() ? functions[f + 1].body : nodes.size();
+
+        if (function.name >= nameCount || function.body >= end || end > nodes.size() ||
+            nodes[function.body].kind != NodeKind::Block ||
+            !isList(function.params, function.paramCount) ||
+            function.autoDeclCount > lists.size() / 2 ||
+            !isList(function.autoDecls, 2 * function.autoDeclCount) ||
+            function.paramCount > function.slotCount) {
+            return false;
+        }
+
+        for (uint32_t i = 0; i < function.paramCount; i++) {
+            if (lists[function.params + i] >= nameCount)
+                return false;
+        }
+
+        for (uint32_t i = 0; i < function.autoDeclCount; i++) {
+            if (lists[function.autoDecls + 2 * i] >= function.slotCount ||
+                lists[function.autoDecls + 2 * i + 1] >= nameCount)
+                return false;
+        }
+
+        auto isChild = [&](NodeIndex parent, uint32_t child) {
+            return child > parent && child < end;
+        };
+
+        auto isExpression = [&](NodeIndex parent, uint32_t child) {
+            return isChild(parent, child) && nodes[child].kind <= NodeKind::FunctionCall;
+        };
+
+        auto isStatement = [&](NodeIndex parent, uint32_t child) {
+            return isChild(parent, child) && nodes[child].kind >= NodeKind::Declaration &&
+                   nodes[child].kind <= NodeKind::Block;
+        };
+
+        auto isLValue = [&](NodeIndex parent, uint32_t child) {
+            return isChild(parent, child) && (nodes[child].kind == NodeKind::Identifier ||
+                                              nodes[child].kind == NodeKind::IndexExpr);
+        };
+
+        // code generation allocates stack slots for these only
+        std::vector<uint32_t> autoSlots;
+        for (uint32_t i = 0; i < function.autoDeclCount; i++) {
+            autoSlots.push_back(lists[function.autoDecls + 2 * i]);
+        }
+        std::sort(autoSlots.begin(), autoSlots.end());
+
+        auto isAuto = [&](uint32_t slot) {
+            return std::binary_search(autoSlots.begin(), autoSlots.end(), slot);
+        };
+
+        // the address of a variable is the one of its stack slot
+        auto isAddressable = [&](NodeIndex parent, uint32_t child) {
+            return isLValue(parent, child) &&
+                   (nodes[child].kind == NodeKind::IndexExpr || isAuto(nodes[child].extra));
+        };
+
+        for (NodeIndex index = function.body; index < end; index++) {
+            const FlatNode& node = nodes[index];
+            bool valid;
+
+            switch (node.kind) {
+                case NodeKind::Identifier:
+                    valid = node.lhs < nameCount && node.extra < function.slotCount;
+                    break;
+                case NodeKind::IntLiteral: valid = node.lhs < literalCount; break;
+                case NodeKind::BinOp:
+                    valid = isBinaryOp(node.data) && isExpression(index, node.rhs) &&
+                            (node.data == OpAssign ? isLValue(index, node.lhs)
+                                                   : isExpression(index, node.lhs));
+                    break;
+                case NodeKind::UnOp:
+                    valid = isUnaryOp(node.data) && (node.data == OpAmp
+                                                         ? isAddressable(index, node.lhs)
+                                                         : isExpression(index, node.lhs));
+                    break;
+                case NodeKind::IndexExpr:
+                    valid = (node.data == 1 || node.data == 2 || node.data == 4 ||
+                             node.data == 8) &&
+                            isExpression(index, node.lhs) && isExpression(index, node.rhs);
+                    break;
+                case NodeKind::WhileStatement:
+                    valid = isExpression(index, node.lhs) && isStatement(index, node.rhs);
+                    break;
+                case NodeKind::ExprStatement: valid = isExpression(index, node.lhs); break;
+                case NodeKind::Declaration:
+                    valid = node.lhs < nameCount && node.extra < function.slotCount &&
+                            isExpression(index, node.rhs) &&
+                            (node.data == FlatAST::DeclRegister ||
+                             (node.data == FlatAST::DeclAuto && isAuto(node.extra)));
+                    break;
+                case NodeKind::IfStatement:
+                    valid = isExpression(index, node.lhs) && isStatement(index, node.rhs) &&
+                            (node.extra == noNode || isStatement(index, node.extra));
+                    break;
+                case NodeKind::ReturnStatement:
+                    valid = node.lhs == noNode || isExpression(index, node.lhs);
+                    break;
+                case NodeKind::FunctionCall:
+                case NodeKind::Block: {
+                    bool isBlock = node.kind == NodeKind::Block;
+                    valid = isList(node.rhs, node.extra) && (isBlock || node.lhs < nameCount);
+
+                    for (uint32_t i = 0; valid && i < node.extra; i++) {
+                        uint32_t element = lists[node.rhs + i];
+                        valid = isBlock ? isStatement(index, element)
+                                        : isExpression(index, element);
+                    }
+                    break;
+                }
+                default: valid = false;
+            }
+
+            if (!valid || !hasDefaultUnused(node)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+}  // namespace
+
+std::optional<FlatAST> ASTCache::load(const std::filesystem::path& cachePath,
+                                      std::string_view source) {
+    std::shared_ptr<const SourceBuffer> file = SourceBuffer::open(cachePath);
+    if (!file || file->view().size() < sizeof(Header)) {
+        return std::nullopt;
+    }
+
+    std::string_view data = file->view();
+    Header header;
+    std::memcpy(&header, data.data(), sizeof(Header));
+
+    if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 ||
+        header.version != formatVersion || header.nodeSize != sizeof(FlatNode) ||
+        header.sourceSize != source.size() || header.sourceHash != hashText(source)) {
+        return std::nullopt;
+    }
+
+    // counts larger than the file would overflow the layout
+    for (uint64_t count : {header.nodeCount, header.literalCount, header.listCount,
+                           header.functionCount, header.nameCount, header.nameBytes,
+                           header.externCount, header.externBytes}) {
+        if (count > data.size()) {
+            return std::nullopt;
+        }
+    }
+
+    Layout layout(header);
+    if (layout.end != data.size() || header.payloadHash != hashText(data.substr(sizeof(Header)))) {
+        return std::nullopt;
+    }
+
+    FlatAST ast;
+    ast.nodes = section<FlatNode>(data, layout.nodes, header.nodeCount);
+    ast.literals = section<uint64_t>(data, layout.literals, header.literalCount);
+    ast.lists = section<uint32_t>(data, layout.lists, header.listCount);
+    ast.functions = section<FlatFunction>(data, layout.functions, header.functionCount);
+    ast.nameOffsets = section<uint32_t>(data, layout.nameOffsets, header.nameCount + 1);
+    ast.nameChars = data.data() + layout.names;
+
+    for (size_t i = 0; i < header.nameCount; i++) {
+        if (ast.nameOffsets[i] > ast.nameOffsets[i + 1] ||
+            ast.nameOffsets[i + 1] > header.nameBytes) {
+            return std::nullopt;
+        }
+    }
+
+    if (!isValid(ast.nodes, header.literalCount, ast.lists, ast.functions, header.nameCount)) {
+        return std::nullopt;
+    }
+
+    auto externs = section<uint32_t>(data, layout.externs, header.externCount * 2);
+    size_t externOffset = layout.externNames;
+
+    for (size_t i = 0; i < header.externCount; i++) {
+        uint32_t paramCount = externs[2 * i];
+        uint32_t length = externs[2 * i + 1];
+
+        if (length > layout.end - externOffset) {
+            return std::nullopt;
+        }
+
+        ast.addExternFunction(std::string(data.substr(externOffset, length)), paramCount);
+        externOffset += length;
+    }
+
+    ast.cacheFile = std::move(file);
+    return ast;
+}
+
+bool ASTCache::store(const std::filesystem::path& cachePath, std::string_view source,
+                     const FlatAST& ast) {
+    Header header;
+    std::memcpy(header.magic, magic, sizeof(magic));
+    header.version = formatVersion;
+    header.nodeSize = sizeof(FlatNode);
+    header.sourceSize = source.size();
+    header.sourceHash = hashText(source);
+
+    header.nodeCount = ast.nodes.size();
+    header.literalCount = ast.literals.size();
+    header.listCount = ast.lists.size();
+    header.functionCount = ast.functions.size();
+    header.nameCount = ast.nameCount();
+    header.externCount = ast.externFunctions.size();
+
+    std::vector<uint32_t> nameOffsets = {0};
+    for (SymbolId symbol = 0; symbol < header.nameCount; symbol++) {
+        nameOffsets.push_back(nameOffsets.back() + ast.name(symbol).size());
+    }
+    header.nameBytes = nameOffsets.back();
+
+    std::vector<uint32_t> externs;
+    header.externBytes = 0;
+    for (auto& [name, paramCount] : ast.externFunctions) {
+        externs.push_back(paramCount);
+        externs.push_back(name.size());
+        header.externBytes += name.size();
+    }
+
+    // the header is filled in once the hash of the payload after it is known
+    Layout layout(header);
+    std::string file(sizeof(Header), '\0');
+    file.reserve(layout.end);
+
+    // pads up to offset first
+    auto write = [&](size_t offset, const void* data, size_t bytes) {
+        file.resize(offset);
+        file.append(static_cast<const char*>(data), bytes);
+    };
+
+    write(layout.nodes, ast.nodes.data(), ast.nodes.size_bytes());
+    write(layout.literals, ast.literals.data(), ast.literals.size_bytes());
+    write(layout.lists, ast.lists.data(), ast.lists.size_bytes());
+    write(layout.functions, ast.functions.data(), ast.functions.size_bytes());
+    write(layout.nameOffsets, nameOffsets.data(), nameOffsets.size() * sizeof(uint32_t));
+
+    for (SymbolId symbol = 0; symbol < header.nameCount; symbol++) {
+        std::string_view name = ast.name(symbol);
+        write(layout.names + nameOffsets[symbol], name.data(), name.size());
+    }
+
+    write(layout.externs, externs.data(), externs.size() * sizeof(uint32_t));
+
+    size_t externOffset = layout.externNames;
+    for (auto& [name, paramCount] : ast.externFunctions) {
+        write(externOffset, name.data(), name.size());
+        externOffset += name.size();
+    }
+
+    header.payloadHash = hashText(std::string_view(file).substr(sizeof(Header)));
+    std::memcpy(file.data(), &header, sizeof(Header));
+
+    // written under a temporary name and renamed, so readers never see a partial file
+    std::filesystem::path tempPath = cachePath.string() + "." + std::to_string(getpid());
+    std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        return false;
+    }
+
+    out.write(file.data(), file.size());
+    out.close();
+
+    std::error_code error;
+    if (out) {
+        std::filesystem::rename(tempPath, cachePath, error);
+    }
+
+    if (!out || error) {
+        std::filesystem::remove(tempPath, error);
+        return false;
+    }
+
+    return true;
+}
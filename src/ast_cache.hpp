@@ -0,0 +1,35 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include "flat_ast.hpp"
+
+namespace clonk {
+
+/**
+ * Binary cache of a FlatAST, kept next to the source file as <source>.astcache. The file starts
+ * with a header holding the format version, the size and hash of the source text and a hash of
+ * the rest, followed by the arrays of the tree as they are laid out in memory. Loading maps the
+ * file and reads the arrays in place, so a cache hit skips lexing and parsing without allocating
+ * per node.
+ *
+ * Only trees of programs without errors are cached, diagnostics are not replayed.
+ */
+class ASTCache {
+   public:
+    static std::filesystem::path pathFor(const std::filesystem::path& sourcePath) {
+        return sourcePath.string() + ".astcache";
+    }
+
+    // The cached tree of source, std::nullopt if the file is missing, belongs to another text or
+    // format version, or is damaged
+    static std::optional<FlatAST> load(const std::filesystem::path& cachePath,
+                                       std::string_view source);
+
+    // Replaces the cache file atomically, returns false if it can not be written
+    static bool store(const std::filesystem::path& cachePath, std::string_view source,
+                      const FlatAST& ast);
+};
+
+}  // end namespace clonk
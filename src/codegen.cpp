@@ -2,121 +2,210 @@
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Verifier.h>
+#include <cassert>
 #include "ast.hpp"
-#include "debug.hpp"
+#include "flat_ast.hpp"
 
 using namespace clonk;
 
-llvm::Value* ASTVisitor::addPHIOperands(std::string_view name, llvm::PHINode* PN, llvm::BasicBlock* BB) {
+llvm::Value* ASTVisitor::addPHIOperands(uint32_t slot, llvm::PHINode* PN, llvm::BasicBlock* BB) {
     for (auto pred = llvm::pred_begin(BB), end = llvm::pred_end(BB); pred != end; ++pred) {
-        PN->addIncoming(readSSAValue(*pred, name), *pred);
+        PN->addIncoming(readSSAValue(*pred, slot), *pred);
     }
 
     return tryRemovePHI(PN);
 }
 
-llvm::Value* ASTVisitor::readSSAValue(llvm::BasicBlock* BB, std::string_view name) {
-    SSABlock& blockMapping = blockMappings[BB];
-    std::string n = BB->getName().str();
+// Reading a value may have to walk up long chains of predecessors, the blocks waiting for the
+// value of a predecessor are kept on a stack instead of recursing.
+llvm::Value* ASTVisitor::readSSAValue(llvm::BasicBlock* BB, uint32_t slot) {
+    struct PendingRead {
+        llvm::BasicBlock* BB;
+        llvm::PHINode* PN;  // nullptr if BB has a single predecessor
+        llvm::pred_iterator nextPred;
+    };
 
+    std::vector<PendingRead> pending;
     llvm::Value* value;
-    if ((value = blockMapping.mappings[name])) {
-        return value;
-    }
 
-    if (!blockMapping.sealed) {
-        llvm::PHINode* PN = builder.CreatePHI(builder.getInt64Ty(), 2);
-        PN->moveBefore(&*BB->getFirstInsertionPt());
-        blockMapping.incompletePhis.emplace_back(name, PN);
-        value = PN;
-    
-    } else if (BB->hasNPredecessors(1)) {
-        value = readSSAValue(BB->getSinglePredecessor(), name);
+    while (true) {
+        SSABlock& blockMapping = blockMappings[BB];
 
-    } else {
-        llvm::PHINode* PN = builder.CreatePHI(builder.getInt64Ty(), 2);
-        PN->moveBefore(&*BB->getFirstInsertionPt());
-        blockMapping.mappings[name] = PN;
-        value = addPHIOperands(name, PN, BB);
-    }
+        if ((value = blockMapping.mappings[slot])) {
+            // known in this block
 
-    blockMapping.mappings[name] = value;
-    return value;
+        } else if (!blockMapping.sealed) {
+            llvm::PHINode* PN = builder.CreatePHI(builder.getInt64Ty(), 2);
+            PN->moveBefore(&*BB->getFirstInsertionPt());
+            blockMapping.incompletePhis.emplace_back(slot, PN);
+            blockMapping.mappings[slot] = PN;
+            value = PN;
 
-}
+        } else if (BB->hasNPredecessors(1)) {
+            pending.push_back({BB, nullptr, llvm::pred_begin(BB)});
+            BB = BB->getSinglePredecessor();
+            continue;
 
-llvm::Value* ASTVisitor::visit(const clonk::ASTNode* node) {
-    if (auto* expr = dynamic_cast<const clonk::Expression*>(node)) {
-        return visitExpression(expr);
-    } else if (auto* stmt = dynamic_cast<const clonk::Statement*>(node)) {
-        return visitStatement(stmt);
-    }
-    return nullptr;
-}
+        } else {
+            llvm::PHINode* PN = builder.CreatePHI(builder.getInt64Ty(), 2);
+            PN->moveBefore(&*BB->getFirstInsertionPt());
+            blockMapping.mappings[slot] = PN;
+
+            llvm::pred_iterator pred = llvm::pred_begin(BB);
+            if (pred != llvm::pred_end(BB)) {
+                pending.push_back({BB, PN, pred});
+                BB = *pred;
+                continue;
+            }
 
-llvm::Value* ASTVisitor::visitExpression(const clonk::Expression* expr, bool getAddr) {
-    if (auto* id = dynamic_cast<const clonk::Identifier*>(expr)) {
-        return visitIdentifier(id);
-    } else if (auto* lit = dynamic_cast<const clonk::IntLiteral*>(expr)) {
-        return visitIntLiteral(lit);
-    } else if (auto* binOp = dynamic_cast<const clonk::BinOp*>(expr)) {
-        return visitBinOp(binOp);
-    } else if (auto* unOp = dynamic_cast<const clonk::UnOp*>(expr)) {
-        return visitUnOp(unOp);
-    } else if (auto* call = dynamic_cast<const clonk::FunctionCall*>(expr)) {
-        return visitFunctionCall(call);
-    } else if (auto* indexExpr = dynamic_cast<const clonk::IndexExpr*>(expr)) {
-        return visitIndexingOp(indexExpr, getAddr);
-    }
+            value = tryRemovePHI(PN);
+            blockMapping.mappings[slot] = value;
+        }
 
-    assert(false && "Unknown expression");
+        // hand the value to the blocks waiting for it, until one needs another predecessor
+        while (!pending.empty()) {
+            PendingRead& read = pending.back();
 
-    return nullptr;
-}
+            if (read.PN) {
+                read.PN->addIncoming(value, *read.nextPred);
 
-llvm::Value* ASTVisitor::visitStatement(const clonk::Statement* stmt) {
-    if (auto* decl = dynamic_cast<const clonk::Declaration*>(stmt)) {
-        return visitDeclaration(decl);
-    } else if (auto* returnStmt = dynamic_cast<const clonk::ReturnStatement*>(stmt)) {
-        return visitReturnStatement(returnStmt);
-    } else if (auto* ifStmt = dynamic_cast<const clonk::IfStatement*>(stmt)) {
-        return visitIfStatement(ifStmt);
-    } else if (auto* whileStmt = dynamic_cast<const clonk::WhileStatement*>(stmt)) {
-        return visitWhileStatement(whileStmt);
-    } else if (auto* block = dynamic_cast<const clonk::Block*>(stmt)) {
-        return visitBlock(block);
-    } else if (auto* exprStmt = dynamic_cast<const clonk::ExprStatement*>(stmt)) {
-        return visitExpression(exprStmt->expr.get());
-    }
+                if (++read.nextPred != llvm::pred_end(read.BB)) {
+                    BB = *read.nextPred;
+                    break;
+                }
 
-    return nullptr;
-}
+                value = tryRemovePHI(read.PN);
+            }
 
-llvm::Value* ASTVisitor::visitIdentifier(const clonk::Identifier* ident) {
-    auto opt = symbolTable.get(ident->name);
-    if (opt) {
-        if(opt->isRegister || opt->isFunctionParam) {
-            return readSSAValue(builder.GetInsertBlock(), ident->name);
+            blockMappings[read.BB].mappings[slot] = value;
+            pending.pop_back();
         }
 
-        return opt->value;
+        if (pending.empty()) {
+            return value;
+        }
     }
-    
-    return nullptr;
 }
 
-llvm::Value* ASTVisitor::visitIntLiteral(const clonk::IntLiteral* lit) {
-    return builder.getInt64(lit->value);
+void ASTVisitor::sealBlock(llvm::BasicBlock* BB) {
+    blockMappings[BB].sealed = true;
+    for (auto& entry : blockMappings[BB].incompletePhis) {
+        addPHIOperands(entry.first, entry.second, BB);
+    }
 }
 
-llvm::Value* ASTVisitor::visitBinOp(const clonk::BinOp* binOp, bool allowBoolResult) {
-    llvm::Value* left = visit(binOp->leftExpr.get());
+llvm::Value* ASTVisitor::visitExpression(NodeIndex expr, bool getAddr, bool allowBoolResult) {
+    pendingExprs.push_back({expr, getAddr, allowBoolResult});
+
+    while (!pendingExprs.empty()) {
+        PendingExpr& pending = pendingExprs.back();
+        const FlatNode& node = ast.node(pending.expr);
+        llvm::Value* value;
+
+        switch (node.kind) {
+            case NodeKind::Identifier: {
+                value = visitIdentifier(node);
+                break;
+            }
+            case NodeKind::IntLiteral: {
+                value = visitIntLiteral(node);
+                break;
+            }
+            case NodeKind::UnOp: {
+                if (pending.stage++ == 0) {
+                    pendingExprs.push_back({node.lhs, node.data == clonk::OpAmp});
+                    continue;
+                }
+
+                value = visitUnOp(node, exprValues.back());
+                exprValues.pop_back();
+                break;
+            }
+            case NodeKind::BinOp: {
+                bool shortCircuit =
+                    node.data == clonk::OpLogicalAnd || node.data == clonk::OpLogicalOr;
+
+                if (pending.stage == 0) {
+                    pending.stage++;
+                    pendingExprs.push_back({node.lhs});
+                    continue;
+                }
+
+                if (pending.stage == 1) {
+                    pending.stage++;
+
+                    if (shortCircuit) {
+                        beginShortCircuit(pending, exprValues.back());
+                        exprValues.pop_back();
+                    }
+
+                    pendingExprs.push_back({node.rhs});
+                    continue;
+                }
+
+                llvm::Value* right = exprValues.back();
+                exprValues.pop_back();
+
+                if (shortCircuit) {
+                    value = finishShortCircuit(pending, right);
+                } else {
+                    value = visitBinOp(node, exprValues.back(), right, pending.allowBoolResult);
+                    exprValues.pop_back();
+                }
+                break;
+            }
+            case NodeKind::IndexExpr: {
+                if (pending.stage < 2) {
+                    pendingExprs.push_back({pending.stage++ ? node.rhs : node.lhs});
+                    continue;
+                }
+
+                llvm::Value* index = exprValues.back();
+                exprValues.pop_back();
+                value = visitIndexExpr(node, exprValues.back(), index, pending.getAddr);
+                exprValues.pop_back();
+                break;
+            }
+            case NodeKind::FunctionCall: {
+                size_t paramCount = node.extra;
+
+                if (pending.stage < paramCount) {
+                    pendingExprs.push_back({ast.list(node.rhs, node.extra)[pending.stage++]});
+                    continue;
+                }
+
+                llvm::ArrayRef<llvm::Value*> args(exprValues);
+                value = visitFunctionCall(node, args.take_back(paramCount));
+                exprValues.resize(exprValues.size() - paramCount);
+                break;
+            }
+            default: assert(false && "not an expression"); __builtin_unreachable();
+        }
 
-    llvm::Value* right = nullptr;
-    if (binOp->op != clonk::OpLogicalAnd && binOp->op != clonk::OpLogicalOr) {
-        right = visit(binOp->rightExpr.get());
+        pendingExprs.pop_back();
+        exprValues.push_back(value);
     }
 
+    llvm::Value* value = exprValues.back();
+    exprValues.pop_back();
+    return value;
+}
+
+llvm::Value* ASTVisitor::visitIdentifier(const FlatNode& ident) {
+    if (llvm::AllocaInst* alloca = slotAllocas[ident.extra]) {
+        return alloca;
+    }
+
+    return readSSAValue(builder.GetInsertBlock(), ident.extra);
+}
+
+llvm::Value* ASTVisitor::visitIntLiteral(const FlatNode& lit) {
+    return builder.getInt64(ast.literal(lit));
+}
+
+llvm::Value* ASTVisitor::visitBinOp(const FlatNode& binOp, llvm::Value* left, llvm::Value* right,
+                                    bool allowBoolResult) {
     llvm::IntegerType* ty = llvm::Type::getInt64Ty(context);
 
     // Load values if operands are pointers
@@ -124,10 +213,10 @@ llvm::Value* ASTVisitor::visitBinOp(const clonk::BinOp* binOp, bool allowBoolRes
         right = builder.CreateLoad(ty, right, right->getName() + ".val");
     }
 
-    if (binOp->op == clonk::OpAssign) {
+    if (binOp.data == clonk::OpAssign) {
         if (!left->getType()->isPointerTy()) {
-            if (const clonk::Identifier* ident = dynamic_cast<const clonk::Identifier*>(binOp->leftExpr.get())) {
-                blockMappings[builder.GetInsertBlock()].mappings[ident->name] = right;
+            if (const FlatNode& ident = ast.node(binOp.lhs); ident.kind == NodeKind::Identifier) {
+                blockMappings[builder.GetInsertBlock()].mappings[ident.extra] = right;
                 return right;
             } else {
                 assert(false && "trying to assign non pointer that isnt a variable");
@@ -142,7 +231,7 @@ llvm::Value* ASTVisitor::visitBinOp(const clonk::BinOp* binOp, bool allowBoolRes
         left = builder.CreateLoad(ty, left, left->getName() + ".val");
     }
 
-    switch (binOp->op) {
+    switch (binOp.data) {
         case clonk::OpPlus: return builder.CreateAdd(left, right);
         case clonk::OpMinus: return builder.CreateSub(left, right);
         case clonk::OpMultiply: return builder.CreateMul(left, right);
@@ -151,6 +240,8 @@ llvm::Value* ASTVisitor::visitBinOp(const clonk::BinOp* binOp, bool allowBoolRes
         case clonk::OpOr: return builder.CreateOr(left, right);
         case clonk::OpXor: return builder.CreateXor(left, right);
         case clonk::OpAmp: return builder.CreateAnd(left, right);
+        case clonk::OpShiftLeft: return builder.CreateShl(left, right);
+        case clonk::OpShiftRight: return builder.CreateAShr(left, right);
 
         // Comparison Operators
         case clonk::OpEquals: {
@@ -177,58 +268,58 @@ llvm::Value* ASTVisitor::visitBinOp(const clonk::BinOp* binOp, bool allowBoolRes
             llvm::Value* value = builder.CreateICmpSLE(left, right);
             return allowBoolResult ? value : builder.CreateSExt(value, builder.getInt64Ty());
         }
-        case clonk::OpLogicalOr:
-        case clonk::OpLogicalAnd: {
-            bool isOr = binOp->op == clonk::OpLogicalOr;
-
-            llvm::BasicBlock* entryBB = builder.GetInsertBlock();
-            llvm::BasicBlock* rhsBB =
-                llvm::BasicBlock::Create(context, "rhs", builder.GetInsertBlock()->getParent());
-            llvm::BasicBlock* endBB =
-                llvm::BasicBlock::Create(context, "end", builder.GetInsertBlock()->getParent());
-            
-            blockMappings[rhsBB].sealed = true;
-            blockMappings[endBB].sealed = false;
-
-            llvm::Value* leftFalse = builder.CreateIsNull(left);
-            if (isOr)
-                builder.CreateCondBr(leftFalse, rhsBB, endBB);
-            else 
-                builder.CreateCondBr(leftFalse, endBB, rhsBB);
-
-            builder.SetInsertPoint(rhsBB);
-            right = visitExpression(binOp->rightExpr.get());
-            if (right && right->getType()->isPointerTy()) {
-                right = builder.CreateLoad(ty, right, right->getName() + ".val");
-            }
+        default: return nullptr;
+    }
+}
 
-            llvm::Value* rightVal = builder.CreateIsNull(right);
-            llvm::Value* result =
-                builder.CreateSelect(rightVal, builder.getInt64(0), builder.getInt64(1));
-            
-            builder.CreateBr(endBB);
-            builder.SetInsertPoint(endBB);
+// Evaluates the right side of && and || only if the left side does not decide the result: the
+// first half branches on the left value, the second joins both paths with a phi.
+void ASTVisitor::beginShortCircuit(PendingExpr& pending, llvm::Value* left) {
+    bool isOr = ast.node(pending.expr).data == clonk::OpLogicalOr;
 
-            blockMappings[endBB].sealed = true;
-            for (auto& entry : blockMappings[endBB].incompletePhis) {
-                addPHIOperands(entry.first, entry.second, endBB);
-            }
+    pending.entryBB = builder.GetInsertBlock();
+    pending.rhsBB = llvm::BasicBlock::Create(context, "rhs", builder.GetInsertBlock()->getParent());
+    pending.endBB = llvm::BasicBlock::Create(context, "end", builder.GetInsertBlock()->getParent());
 
-            llvm::PHINode* phiNode = builder.CreatePHI(llvm::Type::getInt64Ty(context), 2);
-            phiNode->addIncoming(result, rhsBB);
-            phiNode->addIncoming(builder.getInt64(isOr ? 1 : 0), entryBB);
-            return phiNode;
-        }
-        
-        default: return nullptr;
+    blockMappings[pending.rhsBB].sealed = true;
+    blockMappings[pending.endBB].sealed = false;
+
+    llvm::Value* leftFalse = builder.CreateIsNull(left);
+    if (isOr)
+        builder.CreateCondBr(leftFalse, pending.rhsBB, pending.endBB);
+    else
+        builder.CreateCondBr(leftFalse, pending.endBB, pending.rhsBB);
+
+    builder.SetInsertPoint(pending.rhsBB);
+}
+
+llvm::Value* ASTVisitor::finishShortCircuit(const PendingExpr& pending, llvm::Value* right) {
+    bool isOr = ast.node(pending.expr).data == clonk::OpLogicalOr;
+    llvm::IntegerType* ty = llvm::Type::getInt64Ty(context);
+
+    if (right && right->getType()->isPointerTy()) {
+        right = builder.CreateLoad(ty, right, right->getName() + ".val");
     }
+
+    llvm::Value* rightVal = builder.CreateIsNull(right);
+    llvm::Value* result = builder.CreateSelect(rightVal, builder.getInt64(0), builder.getInt64(1));
+
+    // not rhsBB if the right operand short circuits itself
+    llvm::BasicBlock* rhsEndBB = builder.GetInsertBlock();
+    builder.CreateBr(pending.endBB);
+    builder.SetInsertPoint(pending.endBB);
+    sealBlock(pending.endBB);
+
+    llvm::PHINode* phiNode = builder.CreatePHI(ty, 2);
+    phiNode->addIncoming(result, rhsEndBB);
+    phiNode->addIncoming(builder.getInt64(isOr ? 1 : 0), pending.entryBB);
+    return phiNode;
 }
 
-llvm::Value* ASTVisitor::visitUnOp(const clonk::UnOp* unOp) {
-    llvm::Value* expr = visitExpression(unOp->expr.get(), unOp->op == clonk::OpAmp);
+llvm::Value* ASTVisitor::visitUnOp(const FlatNode& unOp, llvm::Value* expr) {
     llvm::Type* ty = llvm::Type::getInt64Ty(context);
 
-    switch (unOp->op) {
+    switch (unOp.data) {
         case clonk::OpAmp: return builder.CreatePtrToInt(expr, ty);
 
         case clonk::OpMinus: return builder.CreateNeg(expr);
@@ -242,13 +333,11 @@ llvm::Value* ASTVisitor::visitUnOp(const clonk::UnOp* unOp) {
     }
 }
 
-llvm::Value* ASTVisitor::visitIndexingOp(const clonk::IndexExpr* indexExpr, bool getAddr) {
-    llvm::Value* expr = visit(indexExpr->array.get());
-    llvm::Value* index = visit(indexExpr->idx.get());
-
+llvm::Value* ASTVisitor::visitIndexExpr(const FlatNode& indexExpr, llvm::Value* expr,
+                                        llvm::Value* index, bool getAddr) {
     if (!expr->getType()->isPointerTy()) {
         expr = builder.CreateIntToPtr(expr, llvm::PointerType::get(expr->getType(), 0));
-    } else if (dynamic_cast<clonk::Identifier*>(indexExpr->array.get())) {
+    } else if (ast.node(indexExpr.lhs).kind == NodeKind::Identifier) {
         expr = builder.CreateLoad(builder.getInt64Ty(), expr);
         expr = builder.CreateIntToPtr(expr, llvm::PointerType::get(expr->getType(), 0));
     }
@@ -256,7 +345,7 @@ llvm::Value* ASTVisitor::visitIndexingOp(const clonk::IndexExpr* indexExpr, bool
     llvm::Type* elementType = nullptr;
     llvm::IntegerType* ty = llvm::Type::getInt64Ty(context);
 
-    switch (indexExpr->sizeSpec) {
+    switch (indexExpr.data) {
         case 1: elementType = llvm::Type::getInt8Ty(context); break;
         case 2: elementType = llvm::Type::getInt16Ty(context); break;
         case 4: elementType = llvm::Type::getInt32Ty(context); break;
@@ -280,41 +369,53 @@ llvm::Value* ASTVisitor::visitIndexingOp(const clonk::IndexExpr* indexExpr, bool
     return loadedValue;
 }
 
-llvm::Value* ASTVisitor::visitFunctionCall(const clonk::FunctionCall* funcCall) {
-    std::vector<llvm::Value*> args;
-    for (const auto& param : funcCall->paramList) {
-        args.push_back(visit(param.get()));
+llvm::Value* ASTVisitor::visitFunctionCall(const FlatNode& funcCall,
+                                           llvm::ArrayRef<llvm::Value*> args) {
+    llvm::Function* func = module.getFunction(ast.name(funcCall.lhs));
+
+    // calls to a folded function go straight to the function it is an alias of
+    if (!func) {
+        if (llvm::GlobalAlias* alias = module.getNamedAlias(ast.name(funcCall.lhs))) {
+            func = llvm::cast<llvm::Function>(alias->getAliasee());
+        }
     }
 
-    llvm::Function* func = module.getFunction(funcCall->ident->name);
+    // not defined yet or extern, declared from the call
     if (!func) {
-        logger::warn("Unknown Function during code gen: " + funcCall->ident->name);
-        exit(EXIT_FAILURE);
+        llvm::IntegerType* ty = builder.getInt64Ty();
+        llvm::FunctionType* funcType =
+            llvm::FunctionType::get(ty, std::vector<llvm::Type*>(args.size(), ty), false);
+
+        func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage,
+                                      ast.name(funcCall.lhs), module);
     }
 
     return builder.CreateCall(func, args);
 }
 
-llvm::Value* ASTVisitor::visitDeclaration(const clonk::Declaration* decl) {
-    llvm::Value* exprValue = visit(decl->expr.get());
+llvm::Value* ASTVisitor::visitDeclaration(const FlatNode& decl) {
+    llvm::Value* exprValue = visitExpression(decl.rhs);
+    bool isRegister = decl.data & FlatAST::DeclRegister;
 
-    if (decl->isRegister) {
-        blockMappings[builder.GetInsertBlock()].mappings[decl->ident->name] = exprValue;
-        symbolTable.insert(decl->ident->name, exprValue, true, false);
+    if (isRegister) {
+        blockMappings[builder.GetInsertBlock()].mappings[decl.extra] = exprValue;
         return exprValue;
 
     } else {
-        llvm::AllocaInst* alloc = autoAllocas[decl->ident->name];
+        llvm::AllocaInst* alloc = slotAllocas[decl.extra];
         assert(alloc && "missing alloca");
         builder.CreateStore(exprValue, alloc);
-        symbolTable.insert(decl->ident->name, alloc, decl->isRegister, false);
         return alloc;
     }
 }
 
-llvm::Value* ASTVisitor::visitReturnStatement(const clonk::ReturnStatement* returnStmt) {
+llvm::Value* ASTVisitor::visitExprStatement(const FlatNode& exprStmt) {
+    return visitExpression(exprStmt.lhs);
+}
+
+llvm::Value* ASTVisitor::visitReturnStatement(const FlatNode& returnStmt) {
     llvm::Value* returnValue =
-        returnStmt->expr ? visit(returnStmt->expr.value().get()) : builder.getInt64(0);
+        returnStmt.lhs != noNode ? visitExpression(returnStmt.lhs) : builder.getInt64(0);
 
     if (returnValue->getType()->isPointerTy()) {
         returnValue = builder.CreateLoad(llvm::Type::getInt64Ty(context), returnValue,
@@ -327,22 +428,92 @@ llvm::Value* ASTVisitor::visitReturnStatement(const clonk::ReturnStatement* retu
     return returnValue;
 }
 
-llvm::Value* ASTVisitor::visitBlock(const clonk::Block* block) {
-    symbolTable.enterScope();
+// Stages of an if statement once its condition is generated
+enum IfStage : unsigned { IfThenBeforeElse = 1, IfLastBranch, IfConstantBranch };
 
-    for (const auto& stmt : block->statements) {
-        auto* v = visit(stmt.get());
-        if (v && dynamic_cast<const clonk::ReturnStatement*>(stmt.get())) {
-            break;
-        }
-    }
+void ASTVisitor::visitStatement(NodeIndex stmt) {
+    pendingStatements.push_back({stmt});
+
+    while (!pendingStatements.empty()) {
+        PendingStatement& pending = pendingStatements.back();
+        const FlatNode& node = ast.node(pending.stmt);
+        NodeIndex next = noNode;  // nested statement to generate before continuing
+
+        switch (node.kind) {
+            case NodeKind::Declaration: {
+                visitDeclaration(node);
+                break;
+            }
+            case NodeKind::ExprStatement: {
+                visitExprStatement(node);
+                break;
+            }
+            case NodeKind::ReturnStatement: {
+                visitReturnStatement(node);
+                break;
+            }
+            case NodeKind::Block: {
+                std::span<const NodeIndex> statements = ast.list(node.rhs, node.extra);
+
+                // statements after a return are unreachable, also after a nested block or an if
+                // with a constant condition that returned
+                if (!currentBBterminated && pending.stage < statements.size()) {
+                    next = statements[pending.stage++];
+                }
+                break;
+            }
+            case NodeKind::WhileStatement: {
+                if (pending.stage++ == 0) {
+                    if (beginWhileStatement(pending)) {
+                        next = node.rhs;
+                    }
+                } else {
+                    finishWhileStatement(pending);
+                }
+                break;
+            }
+            case NodeKind::IfStatement: {
+                if (pending.stage == 0) {
+                    next = beginIfStatement(pending);
+
+                } else if (pending.stage == IfThenBeforeElse) {
+                    terminateBB(pending.endBB);
 
-    symbolTable.leaveScope();
+                    builder.SetInsertPoint(pending.nextBB);
+                    blockMappings[pending.nextBB].sealed = true;
+                    pending.stage = IfLastBranch;
+                    next = node.extra;
 
-    return nullptr;
+                } else if (pending.stage == IfConstantBranch && currentBBterminated) {
+                    // the only branch returned, nothing reaches the end
+                    blockMappings.erase(pending.endBB);
+                    pending.endBB->eraseFromParent();
+
+                } else {
+                    terminateBB(pending.endBB);
+
+                    if (pending.stage == IfLastBranch) {
+                        sealBlock(pending.endBB);
+                    }
+
+                    builder.SetInsertPoint(pending.endBB);
+                }
+                break;
+            }
+            default: assert(false && "not a statement"); __builtin_unreachable();
+        }
+
+        if (next != noNode) {
+            pendingStatements.push_back({next});
+        } else {
+            pendingStatements.pop_back();
+        }
+    }
 }
 
-llvm::Value* ASTVisitor::visitWhileStatement(const clonk::WhileStatement* whileStmt) {
+// Generates the loop condition, returns whether the loop body has to be generated next
+bool ASTVisitor::beginWhileStatement(PendingStatement& pending) {
+    const FlatNode& whileStmt = ast.node(pending.stmt);
     std::string loopName = "loop" + std::to_string(variableIndex++);
     llvm::Type* ty = llvm::Type::getInt64Ty(context);
 
@@ -353,7 +524,7 @@ llvm::Value* ASTVisitor::visitWhileStatement(const clonk::WhileStatement* whileS
     builder.SetInsertPoint(loopCondBB);
     blockMappings[loopCondBB].sealed = false;
 
-    llvm::Value* condition = visit(whileStmt->condition.get());
+    llvm::Value* condition = visitExpression(whileStmt.lhs);
     llvm::BasicBlock* loopBodyBB = nullptr;
     llvm::BasicBlock* loopEndBB =
         llvm::BasicBlock::Create(context, loopName + ".end", currentFunction);
@@ -366,7 +537,7 @@ llvm::Value* ASTVisitor::visitWhileStatement(const clonk::WhileStatement* whileS
             builder.SetInsertPoint(loopEndBB);
             blockMappings[loopEndBB].sealed = true;
 
-            return nullptr;
+            return false;
 
         } else {
             // while (true)
@@ -388,21 +559,23 @@ llvm::Value* ASTVisitor::visitWhileStatement(const clonk::WhileStatement* whileS
     }
 
     builder.SetInsertPoint(loopBodyBB);
-    visitStatement(whileStmt->statement.get());
-    terminateBB(loopCondBB);
-
-    blockMappings[loopCondBB].sealed = true;
-    for (auto& entry : blockMappings[loopCondBB].incompletePhis) {
-        addPHIOperands(entry.first, entry.second, loopCondBB);
-    }
+    pending.nextBB = loopCondBB;
+    pending.endBB = loopEndBB;
+    return true;
+}
 
-    builder.SetInsertPoint(loopEndBB);
-    blockMappings[loopEndBB].sealed = true;
+void ASTVisitor::finishWhileStatement(const PendingStatement& pending) {
+    terminateBB(pending.nextBB);
+    sealBlock(pending.nextBB);
 
-    return nullptr;
+    builder.SetInsertPoint(pending.endBB);
+    blockMappings[pending.endBB].sealed = true;
 }
 
-llvm::Value* ASTVisitor::visitIfStatement(const clonk::IfStatement* ifStmt) {
+// Generates the condition and branch, returns the first branch to generate and sets the stage
+// to continue with once it is done
+NodeIndex ASTVisitor::beginIfStatement(PendingStatement& pending) {
+    const FlatNode& ifStmt = ast.node(pending.stmt);
     std::string ifname = "if" + std::to_string(variableIndex++);
     llvm::Type* ty = llvm::Type::getInt64Ty(context);
 
@@ -412,44 +585,33 @@ llvm::Value* ASTVisitor::visitIfStatement(const clonk::IfStatement* ifStmt) {
     builder.SetInsertPoint(ifCondBB);
     blockMappings[ifCondBB].sealed = true;
 
-    llvm::Value* condition;
-    if (auto binOp = dynamic_cast<const BinOp*>(ifStmt->condition.get())) {
-        condition = visitBinOp(binOp, true);
-    } else {
-        condition = visitExpression(ifStmt->condition.get());
-    }
+    llvm::Value* condition = visitExpression(ifStmt.lhs, false, true);
 
     llvm::BasicBlock* ifEndBB = llvm::BasicBlock::Create(context, ifname + ".end", currentFunction);
     blockMappings[ifEndBB].sealed = false;
+    pending.endBB = ifEndBB;
 
     // check constant in if condition
     if (llvm::Constant* constCond = llvm::dyn_cast<llvm::Constant>(condition)) {
 
         // Only one path to if.end
         blockMappings[ifEndBB].sealed = true;
+        pending.stage = IfConstantBranch;
 
-        if (constCond->isZeroValue()) {
-            llvm::Value* value = nullptr;
-            if (ifStmt->elseStatement) {
-                value = visit(ifStmt->elseStatement->get());
-            }
-
-            terminateBB(ifEndBB);
-            builder.SetInsertPoint(ifEndBB);
-            return value;
+        NodeIndex branch = constCond->isZeroValue() ? ifStmt.extra : ifStmt.rhs;
 
-        } else {
-            visitStatement(ifStmt->statement.get());
+        if (branch == noNode) {
             terminateBB(ifEndBB);
             builder.SetInsertPoint(ifEndBB);
-            return nullptr;
         }
+
+        return branch;
     }
 
     llvm::BasicBlock* ifBodyBB =
         llvm::BasicBlock::Create(context, ifname + ".body", currentFunction);
     llvm::BasicBlock* elseBodyBB =
-        (ifStmt->elseStatement)
+        (ifStmt.extra != noNode)
             ? llvm::BasicBlock::Create(context, ifname + ".else", currentFunction)
             : nullptr;
 
@@ -461,45 +623,39 @@ llvm::Value* ASTVisitor::visitIfStatement(const clonk::IfStatement* ifStmt) {
     blockMappings[ifBodyBB].sealed = true;
 
     // check if else statement exists
-    if (!ifStmt->elseStatement) {
+    if (ifStmt.extra == noNode) {
         builder.CreateCondBr(conditionValue, ifEndBB, ifBodyBB);
-        builder.SetInsertPoint(ifBodyBB);
-
-        visitStatement(ifStmt->statement.get());
-        terminateBB(ifEndBB);
+        pending.stage = IfLastBranch;
 
     } else {
         builder.CreateCondBr(conditionValue, elseBodyBB, ifBodyBB);
-        builder.SetInsertPoint(ifBodyBB);
-
-        visitStatement(ifStmt->statement.get());
-        terminateBB(ifEndBB);
-
-        builder.SetInsertPoint(elseBodyBB);
-        blockMappings[elseBodyBB].sealed = true;
-        visitStatement(ifStmt->elseStatement->get());
-        terminateBB(ifEndBB);
-    }
-
-    blockMappings[ifEndBB].sealed = true;
-    for (auto& entry : blockMappings[ifEndBB].incompletePhis) {
-        addPHIOperands(entry.first, entry.second, ifEndBB);
+        pending.nextBB = elseBodyBB;
+        pending.stage = IfThenBeforeElse;
     }
 
-    builder.SetInsertPoint(ifEndBB);
-    return nullptr;
+    builder.SetInsertPoint(ifBodyBB);
+    return ifStmt.rhs;
 }
 
-llvm::Function* ASTVisitor::visitFunction(const clonk::Function* func) {
+llvm::Function* ASTVisitor::visitFunction(const FlatFunction& func) {
     variableIndex = 0;  // reset
+    currentBBterminated = false;
 
     llvm::IntegerType* ty = builder.getInt64Ty();
 
     llvm::FunctionType* funcType =
-        llvm::FunctionType::get(ty, std::vector<llvm::Type*>(func->params.size(), ty), false);
+        llvm::FunctionType::get(ty, std::vector<llvm::Type*>(func.paramCount, ty), false);
+
+    // a function that was called before it is defined is already declared
+    llvm::Function* llvmFunc = module.getFunction(ast.name(func.name));
 
-    llvm::Function* llvmFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage,
-                                                      func->ident->name, module);
+    if (!llvmFunc || !llvmFunc->isDeclaration() || llvmFunc->getFunctionType() != funcType) {
+        llvmFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage,
+                                          ast.name(func.name), module);
+    }
+
+    // blocks of earlier functions may have been freed
+    blockMappings.clear();
 
     llvm::BasicBlock* BB = llvm::BasicBlock::Create(context, "entry", llvmFunc);
     
@@ -507,22 +663,93 @@ llvm::Function* ASTVisitor::visitFunction(const clonk::Function* func) {
     builder.SetInsertPoint(BB);
     this->currentFunction = llvmFunc;
 
-    auto paramIt = func->params.begin();
+    // parameters are the first slots
+    std::span<const SymbolId> params = ast.list(func.params, func.paramCount);
     for (llvm::Argument& llvmParam : llvmFunc->args()) {
-        llvmParam.setName((*paramIt)->name);
-        blockMappings[BB].mappings[(*paramIt)->name] = &llvmParam;
-        symbolTable.insert((*paramIt)->name, nullptr, false, true);
-        ++paramIt;
+        llvmParam.setName(ast.name(params[llvmParam.getArgNo()]));
+        blockMappings[BB].mappings[llvmParam.getArgNo()] = &llvmParam;
     }
 
-    for (std::string_view varName : func->autoDecls) {
-        autoAllocas[varName] = builder.CreateAlloca(ty, nullptr, varName);
+    slotAllocas.assign(func.slotCount, nullptr);
+    std::span<const uint32_t> autoDecls = ast.list(func.autoDecls, 2 * func.autoDeclCount);
+
+    for (size_t i = 0; i < autoDecls.size(); i += 2) {
+        slotAllocas[autoDecls[i]] = builder.CreateAlloca(ty, nullptr, ast.name(autoDecls[i + 1]));
     }
 
-    visitBlock(func->block.get());
+    visitStatement(func.body);
     if (!currentBBterminated) {
         builder.CreateRet(builder.getInt64(0));
     }
 
     return llvmFunc;
 }
+
+FunctionStreamer::FunctionStreamer(const std::string& name, std::ostream& out,
+                                   std::shared_ptr<const SourceBuffer> source,
+                                   std::shared_ptr<const StringInterner> interner, bool optimize)
+    : module(name, context),
+      builder(context),
+      ast(std::move(source), std::move(interner)),
+      visitor(context, module, builder, ast),
+      out(out),
+      optimize(optimize) {
+    module.print(this->out, nullptr);
+}
+
+void FunctionStreamer::add(const Function& function) {
+    ast.clear();
+    ast.addFunction(function);
+
+    if (optimize) {
+        ast.simplify();
+    }
+
+    llvm::Function* llvmFunc = visitor.visitFunction(ast.getFunctions().front());
+
+    if (llvm::verifyFunction(*llvmFunc, &llvm::errs())) {
+        llvmFunc->print(llvm::errs());
+        assert(false && "Invalid Function!");
+    }
+
+    // a fatal error exits without unwinding, what was generated before is shown
+    out << "\n";
+    llvmFunc->print(out);
+    out.flush();
+
+    defined.insert(llvmFunc->getName());
+    llvmFunc->eraseFromParent();
+
+    // Printing numbers the values of the whole module, so it only ever holds one function and
+    // the declarations it calls. Callees are declared again by the next function that calls them.
+    while (!module.empty()) {
+        llvm::Function& callee = *module.begin();
+
+        if (called.insert(callee.getName()).second) {
+            calledInOrder.emplace_back(callee.getName(), callee.arg_size());
+        }
+
+        callee.eraseFromParent();
+    }
+}
+
+void FunctionStreamer::finish() {
+    llvm::IntegerType* ty = builder.getInt64Ty();
+
+    for (auto& [name, paramCount] : calledInOrder) {
+        if (defined.contains(name)) {
+            continue;
+        }
+
+        llvm::FunctionType* funcType =
+            llvm::FunctionType::get(ty, std::vector<llvm::Type*>(paramCount, ty), false);
+        llvm::Function* declaration =
+            llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, name, module);
+
+        out << "\n";
+        declaration->print(out);
+        declaration->eraseFromParent();
+    }
+
+    out.flush();
+}
@@ -1,9 +1,13 @@
 #pragma once
 
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/DenseMap.h>
 #include <llvm/ADT/STLFunctionalExtras.h>
+#include <llvm/ADT/StringSet.h>
 #include <llvm/ADT/StringRef.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalAlias.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/Instructions.h>
 #include <llvm/IR/LLVMContext.h>
@@ -11,31 +15,61 @@
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Value.h>
 #include <llvm/Support/Casting.h>
+#include <llvm/Support/raw_os_ostream.h>
 #include <llvm/Support/raw_ostream.h>
 #include <cstdlib>
 #include <memory>
+#include <ostream>
+#include <span>
 #include <string>
 #include <string_view>
 #include <unordered_map>
 #include <vector>
 #include "ast.hpp"
+#include "flat_ast.hpp"
+#include "interner.hpp"
+#include "source.hpp"
 
 namespace clonk {
 
+// Values of the parameters and registers in a block, by variable slot
 struct SSABlock {
     bool sealed;
-    std::unordered_map<std::string_view, llvm::Value*> mappings;
-    std::vector<std::pair<std::string_view, llvm::PHINode*>> incompletePhis;
+    llvm::DenseMap<uint32_t, llvm::Value*> mappings;
+    std::vector<std::pair<uint32_t, llvm::PHINode*>> incompletePhis;
 };
 
 class ASTVisitor {
    private:
+    // Node whose code is being generated. Operands and nested statements are generated from
+    // explicit stacks instead of recursing, so nesting depth is bounded by heap memory only.
+    struct PendingExpr {
+        NodeIndex expr;
+        bool getAddr = false;
+        bool allowBoolResult = false;
+        unsigned stage = 0;  // number of operands generated so far
+
+        // && and ||
+        llvm::BasicBlock* entryBB = nullptr;
+        llvm::BasicBlock* rhsBB = nullptr;
+        llvm::BasicBlock* endBB = nullptr;
+    };
+
+    struct PendingStatement {
+        NodeIndex stmt;
+        unsigned stage = 0;
+        llvm::BasicBlock* endBB = nullptr;
+        llvm::BasicBlock* nextBB = nullptr;  // loop condition or else body
+    };
+
     llvm::LLVMContext& context;
     llvm::Module& module;
     llvm::IRBuilder<>& builder;
+    const FlatAST& ast;
 
-    SymbolTable<llvm::Value*> symbolTable;
-    std::unordered_map<std::string_view, llvm::AllocaInst*> autoAllocas;
+    // indexed by variable slot, nullptr for parameters and registers, whose values are
+    // tracked per block
+    std::vector<llvm::AllocaInst*> slotAllocas;
 
     std::unordered_map<llvm::BasicBlock*, SSABlock> blockMappings;
     bool currentBBterminated = false;
@@ -43,43 +77,65 @@ class ASTVisitor {
     llvm::Function* currentFunction = nullptr;
     int variableIndex = 0;
 
+    // work stacks, kept to reuse their memory
+    std::vector<PendingExpr> pendingExprs;
+    std::vector<llvm::Value*> exprValues;
+    std::vector<PendingStatement> pendingStatements;
+
     void terminateBB(llvm::BasicBlock* BB) {
         if (!currentBBterminated)
             builder.CreateBr(BB);
         currentBBterminated = false;
     }
 
+    void sealBlock(llvm::BasicBlock* BB);
+
+    void beginShortCircuit(PendingExpr& pending, llvm::Value* left);
+    llvm::Value* finishShortCircuit(const PendingExpr& pending, llvm::Value* right);
+
+    bool beginWhileStatement(PendingStatement& pending);
+    void finishWhileStatement(const PendingStatement& pending);
+    NodeIndex beginIfStatement(PendingStatement& pending);
+
    public:
-    ASTVisitor(llvm::LLVMContext& ctx, llvm::Module& mod, llvm::IRBuilder<>& irBuilder)
-        : context(ctx), module(mod), builder(irBuilder) {}
+    ASTVisitor(llvm::LLVMContext& ctx, llvm::Module& mod, llvm::IRBuilder<>& irBuilder,
+               const FlatAST& ast)
+        : context(ctx), module(mod), builder(irBuilder), ast(ast) {}
 
     // SSA construction
-    llvm::Value* readSSAValue(llvm::BasicBlock* BB, std::string_view name);
+    llvm::Value* readSSAValue(llvm::BasicBlock* BB, uint32_t slot);
     llvm::Value* tryRemovePHI(llvm::PHINode* PN) { return PN; }; // TODO
-    llvm::Value* addPHIOperands(std::string_view name, llvm::PHINode* PN, llvm::BasicBlock* BB);
-
-    llvm::Value* visit(const clonk::ASTNode* node);
-    llvm::Value* visitExpression(const clonk::Expression* expr, bool getAddr = false);
-    llvm::Value* visitStatement(const clonk::Statement* stmt);
-    llvm::Value* visitIdentifier(const clonk::Identifier* id);
-    llvm::Value* visitIntLiteral(const clonk::IntLiteral* lit);
-    llvm::Value* visitBinOp(const clonk::BinOp* binOp, bool allowBoolResult = false);
-    llvm::Value* visitUnOp(const clonk::UnOp* unOp);
-    llvm::Value* visitIndexingOp(const clonk::IndexExpr* indexExpr, bool getAddr = false);
-    llvm::Value* visitFunctionCall(const clonk::FunctionCall* funcCall);
-    llvm::Value* visitDeclaration(const clonk::Declaration* decl);
-    llvm::Value* visitReturnStatement(const clonk::ReturnStatement* returnStmt);
-    llvm::Value* visitBlock(const clonk::Block* block);
-    llvm::Value* visitWhileStatement(const clonk::WhileStatement* whileStmt);
-    llvm::Value* visitIfStatement(const clonk::IfStatement* ifStmt);
-    llvm::Function* visitFunction(const clonk::Function* func);
+    llvm::Value* addPHIOperands(uint32_t slot, llvm::PHINode* PN, llvm::BasicBlock* BB);
+
+    // Yields the address instead of the value for indexing expressions with getAddr, and an i1
+    // for comparisons with allowBoolResult
+    llvm::Value* visitExpression(NodeIndex expr, bool getAddr = false,
+                                 bool allowBoolResult = false);
+    void visitStatement(NodeIndex stmt);
+
+    // code for a single node, with its operands already generated
+    llvm::Value* visitIdentifier(const FlatNode& ident);
+    llvm::Value* visitIntLiteral(const FlatNode& lit);
+    llvm::Value* visitBinOp(const FlatNode& binOp, llvm::Value* left, llvm::Value* right,
+                            bool allowBoolResult = false);
+    llvm::Value* visitUnOp(const FlatNode& unOp, llvm::Value* expr);
+    llvm::Value* visitIndexExpr(const FlatNode& indexExpr, llvm::Value* expr, llvm::Value* index,
+                                bool getAddr = false);
+    llvm::Value* visitFunctionCall(const FlatNode& funcCall, llvm::ArrayRef<llvm::Value*> args);
+    llvm::Value* visitDeclaration(const FlatNode& decl);
+    llvm::Value* visitExprStatement(const FlatNode& exprStmt);
+    llvm::Value* visitReturnStatement(const FlatNode& returnStmt);
+    llvm::Function* visitFunction(const FlatFunction& func);
 };
 
+// Generates code for the functions named in roots and those they call, directly or not, or for
+// all functions if roots is empty
 inline std::unique_ptr<llvm::Module> createModule(llvm::LLVMContext& ctx, const std::string& name,
-                                                  const AbstractSyntaxTree& ast) {
+                                                  const FlatAST& ast,
+                                                  std::span<const std::string> roots = {}) {
     auto module = std::make_unique<llvm::Module>(name, ctx);
     auto builder = llvm::IRBuilder<>(ctx);
-    auto astVisitor = ASTVisitor(ctx, *module, builder);
+    auto astVisitor = ASTVisitor(ctx, *module, builder, ast);
 
     llvm::Type* ty = builder.getInt64Ty();
 
@@ -92,11 +148,79 @@ inline std::unique_ptr<llvm::Module> createModule(llvm::LLVMContext& ctx, const
                                *module);
     }
 
-    for (const std::unique_ptr<clonk::Function>& func : ast.getFunctions()) {
-        astVisitor.visitFunction(func.get());
+    std::span<const FlatFunction> functions = ast.getFunctions();
+    std::vector<bool> reachable = roots.empty() ? std::vector<bool>(functions.size(), true)
+                                                : ast.findReachableFunctions(roots);
+
+    // a function with the same body as one before it is only an alias of that one, the first
+    // function of such a group that is generated gets the body
+    std::vector<uint32_t> identical = ast.findIdenticalFunctions();
+    std::vector<llvm::Function*> llvmFunctions(functions.size());
+
+    for (uint32_t i = 0; i < functions.size(); i++) {
+        if (!reachable[i]) {
+            continue;
+        }
+
+        llvm::Function*& original = llvmFunctions[identical[i]];
+        if (!original) {
+            original = astVisitor.visitFunction(functions[i]);
+            continue;
+        }
+
+        // calls that came before went to a declaration
+        llvm::Function* declaration = module->getFunction(ast.name(functions[i].name));
+        if (declaration && declaration->getFunctionType() == original->getFunctionType()) {
+            declaration->replaceAllUsesWith(original);
+            declaration->eraseFromParent();
+        }
+
+        llvm::GlobalAlias::create(original->getFunctionType(), 0, llvm::Function::ExternalLinkage,
+                                  ast.name(functions[i].name), original, module.get());
     }
 
     return module;
 }
 
+inline std::unique_ptr<llvm::Module> createModule(llvm::LLVMContext& ctx, const std::string& name,
+                                                  const AbstractSyntaxTree& ast,
+                                                  std::span<const std::string> roots = {}) {
+    return createModule(ctx, name, FlatAST(ast), roots);
+}
+
+/**
+ * Generates and prints code one function at a time, for programs too large to keep as a whole.
+ * Each function is flattened, lowered, printed and freed before the next one is added, so memory
+ * is bounded by the largest function instead of the program. Called functions are declared on
+ * demand, those never defined are printed as declarations by finish(). Identical functions are
+ * not folded, the bodies to compare with are gone.
+ */
+class FunctionStreamer {
+    llvm::LLVMContext context;
+    llvm::Module module;
+    llvm::IRBuilder<> builder;
+    FlatAST ast;  // only the function being generated
+    ASTVisitor visitor;
+    llvm::raw_os_ostream out;
+
+    bool optimize;
+
+    llvm::StringSet<> defined;
+    llvm::StringSet<> called;
+    std::vector<std::pair<std::string, unsigned>> calledInOrder;  // name, param count
+
+   public:
+    // Prints the module header. With optimize, each function is simplified before its code is
+    // generated, see FlatAST::simplify().
+    FunctionStreamer(const std::string& name, std::ostream& out,
+                     std::shared_ptr<const SourceBuffer> source,
+                     std::shared_ptr<const StringInterner> interner, bool optimize = true);
+
+    // Generates and prints function, which may be freed afterwards
+    void add(const Function& function);
+
+    // Prints the declarations of called functions that were never defined
+    void finish();
+};
+
 }  // end namespace clonk
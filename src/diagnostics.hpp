@@ -2,33 +2,42 @@
 
 #include <cstdlib>
 #include <iostream>
+#include <memory>
 #include <ostream>
 #include <string>
 #include <vector>
 #include "lexer.hpp"
+#include "source.hpp"
 
 namespace clonk {
 
+// An error at an offset in the input. Line and column are only resolved when it is printed.
 class DiagnosticError {
 
-    const std::string line;
-    const int lineNum;
-    const int linePosition;
-    const std::string message;
+    std::shared_ptr<const SourceLocationIndex> locations;
+    size_t offset;
+    std::string message;
+    std::string line;  // only captured for streamed input, whose text is released while parsing
 
    public:
-    DiagnosticError(std::string line, int lineNum, int linePosition,
+    DiagnosticError(std::shared_ptr<const SourceLocationIndex> locations, size_t offset,
                     const std::string& message = "")
-        : line(line), lineNum(lineNum), linePosition(linePosition), message(message) {}
+        : locations(std::move(locations)), offset(offset), message(message) {
+        if (this->locations->isStreaming()) {
+            line = std::string(this->locations->locate(offset).lineText);
+        }
+    }
 
     friend std::ostream& operator<<(std::ostream& os, const DiagnosticError& err);
 };
 
 inline std::ostream& operator<<(std::ostream& os, const DiagnosticError& err) {
-    os << "error in line " << err.lineNum << ": ";
+    SourceLocationIndex::Location location = err.locations->locate(err.offset);
+
+    os << "error in line " << location.line << ": ";
     os << err.message << std::endl;
-    os << err.line << std::endl;
-    std::string indent(err.linePosition, '-');
+    os << (err.locations->isStreaming() ? err.line : location.lineText) << std::endl;
+    std::string indent(location.column, '-');
     os << indent << '^' << std::endl;
 
     return os;
@@ -38,28 +47,44 @@ class DiagnosticsManager {
     std::vector<DiagnosticError> errors;
     bool _isError = false;
 
+    static inline thread_local DiagnosticsManager* threadInstance = nullptr;
+
    public:
     static DiagnosticsManager& get() {
+        if (threadInstance) {
+            return *threadInstance;
+        }
+
         static DiagnosticsManager instance;
         return instance;
     }
 
-    void unknownToken(const TokenStream& ts) {
-        std::string line = std::string(ts.getCurrentLine());
-        int lineNum = ts.getCurrentLineNumber();
-        int linePosition = ts.getLinePosition();
+    // While it exists, get() on the constructing thread returns manager instead of the global
+    // instance. Lets worker threads collect their diagnostics separately.
+    class ThreadRedirect {
+        DiagnosticsManager* previous;
 
-        errors.emplace_back(line, lineNum, linePosition, "Unknown token");
+       public:
+        explicit ThreadRedirect(DiagnosticsManager& manager) : previous(threadInstance) {
+            threadInstance = &manager;
+        }
+
+        ThreadRedirect(const ThreadRedirect&) = delete;
+        ThreadRedirect& operator=(const ThreadRedirect&) = delete;
+
+        ~ThreadRedirect() { threadInstance = previous; }
+    };
+
+    void unknownToken(const TokenStream& ts) { unknownToken(ts, ts.getLexerOffset()); }
+
+    void unknownToken(const TokenStream& ts, size_t offset) {
+        errors.emplace_back(ts.getLocations(), offset, "Unknown token");
         printErrors(std::cerr);
         exit(EXIT_FAILURE);
     }
 
     void unexpectedToken(const TokenStream& ts, const Token& token,
                          const std::string& expected = "") {
-        std::string line = std::string(ts.getCurrentLine());
-        int lineNum = ts.getCurrentLineNumber();
-        int linePosition = ts.getLinePosition();
-
         std::string message;
 
         if (token.type == TokenType::EndOfFile) {
@@ -71,16 +96,17 @@ class DiagnosticsManager {
         if (!expected.empty())
             message += ", expected \"" + expected + "\"";
 
-        errors.emplace_back(line, lineNum, linePosition, message);
+        errors.emplace_back(ts.getLocations(), token.offset, message);
         _isError = true;
     }
 
+    // Error at the token last consumed from ts
     void error(const TokenStream& ts, const std::string& message = "") {
-        std::string line = std::string(ts.getCurrentLine());
-        int lineNum = ts.getCurrentLineNumber();
-        int linePosition = ts.getLinePosition();
+        error(ts, ts.getOffset(), message);
+    }
 
-        errors.emplace_back(line, lineNum, linePosition, message);
+    void error(const TokenStream& ts, size_t offset, const std::string& message) {
+        errors.emplace_back(ts.getLocations(), offset, message);
         _isError = true;
     }
 
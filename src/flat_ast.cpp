@@ -0,0 +1,735 @@
+#include "flat_ast.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ast.hpp"
+
+using namespace clonk;
+
+// The value code generation computes for op on two constants, std::nullopt for assignments and
+// where the result would be undefined
+static std::optional<uint64_t> foldBinOp(TokenType op, uint64_t left, uint64_t right) {
+    int64_t signedLeft = left, signedRight = right;
+
+    switch (op) {
+        case OpPlus: return left + right;
+        case OpMinus: return left - right;
+        case OpMultiply: return left * right;
+        case OpDivide:
+        case OpModulo:
+            if (signedRight == 0 ||
+                (signedLeft == std::numeric_limits<int64_t>::min() && signedRight == -1)) {
+                return std::nullopt;
+            }
+            return op == OpDivide ? signedLeft / signedRight : signedLeft % signedRight;
+        case OpOr: return left | right;
+        case OpXor: return left ^ right;
+        case OpAmp: return left & right;
+        case OpShiftLeft:
+            return right < 64 ? std::optional<uint64_t>(left << right) : std::nullopt;
+        case OpShiftRight:
+            return right < 64 ? std::optional<uint64_t>(signedLeft >> right) : std::nullopt;
+        case OpLogicalAnd: return left != 0 && right != 0;
+        case OpLogicalOr: return left != 0 || right != 0;
+
+        // comparisons are sign extended from i1
+        case OpEquals: return -uint64_t(signedLeft == signedRight);
+        case OpNotEquals: return -uint64_t(signedLeft != signedRight);
+        case OpGreaterThan: return -uint64_t(signedLeft > signedRight);
+        case OpGreaterEq: return -uint64_t(signedLeft >= signedRight);
+        case OpLessThan: return -uint64_t(signedLeft < signedRight);
+        case OpLessEq: return -uint64_t(signedLeft <= signedRight);
+        default: return std::nullopt;
+    }
+}
+
+FlatAST::FlatAST(const AbstractSyntaxTree& ast)
+    : source(ast.getSource()), interner(ast.getInterner()) {
+    for (const Function* function : ast.getFunctions()) {
+        addFunction(*function);
+    }
+
+    externFunctions = ast.getExternFunctions();
+}
+
+void FlatAST::addFunction(const Function& function) {
+    FlatFunction flat;
+    flat.name = function.ident->symbol;
+
+    flat.params = listStorage.size();
+    flat.paramCount = function.params.size();
+    for (const Identifier* param : function.params) {
+        listStorage.push_back(param->symbol);
+    }
+
+    flat.autoDecls = listStorage.size();
+    flat.autoDeclCount = function.autoDecls.size();
+    for (const Identifier* var : function.autoDecls) {
+        listStorage.push_back(var->slot);
+        listStorage.push_back(var->symbol);
+    }
+
+    flat.slotCount = function.slotCount;
+
+    flat.body = addNodes(function.block);
+    functionStorage.push_back(flat);
+    updateViews();
+}
+
+// Lays out the subtree of root in pre-order. A node's index is only known once it is added, so
+// every pending node remembers the field it has to be stored in: a field of its parent, or a
+// slot of a list.
+NodeIndex FlatAST::addNodes(const Statement* root) {
+    enum class Field : uint8_t { Lhs, Rhs, Extra, List };
+
+    struct Pending {
+        const ASTNode* node;
+        uint32_t owner;  // parent node or list slot, noNode for root
+        Field field;
+    };
+
+    NodeIndex rootIndex = nodeStorage.size();
+    std::vector<Pending> pending = {{root, noNode, Field::Lhs}};
+
+    // children are pushed in reverse, so that the first child is laid out first
+    auto addList = [&](auto children) {
+        uint32_t first = listStorage.size();
+        listStorage.resize(first + children.size());
+
+        for (size_t i = children.size(); i-- > 0;) {
+            pending.push_back({children[i], uint32_t(first + i), Field::List});
+        }
+
+        return first;
+    };
+
+    while (!pending.empty()) {
+        Pending next = pending.back();
+        pending.pop_back();
+
+        NodeIndex index = nodeStorage.size();
+        if (next.owner != noNode) {
+            switch (next.field) {
+                case Field::Lhs: nodeStorage[next.owner].lhs = index; break;
+                case Field::Rhs: nodeStorage[next.owner].rhs = index; break;
+                case Field::Extra: nodeStorage[next.owner].extra = index; break;
+                case Field::List: listStorage[next.owner] = index; break;
+            }
+        }
+
+        // no nodes are added until the next iteration, the reference stays valid
+        FlatNode& node = nodeStorage.emplace_back(FlatNode{next.node->kind});
+
+        switch (next.node->kind) {
+            case NodeKind::Identifier: {
+                auto ident = static_cast<const Identifier*>(next.node);
+                node.lhs = ident->symbol;
+                node.extra = ident->slot;
+                break;
+            }
+            case NodeKind::IntLiteral: {
+                node.lhs = literalStorage.size();
+                literalStorage.push_back(static_cast<const IntLiteral*>(next.node)->value);
+                break;
+            }
+            case NodeKind::BinOp: {
+                auto binOp = static_cast<const BinOp*>(next.node);
+                node.data = binOp->op;
+                pending.push_back({binOp->rightExpr, index, Field::Rhs});
+                pending.push_back({binOp->leftExpr, index, Field::Lhs});
+                break;
+            }
+            case NodeKind::UnOp: {
+                auto unOp = static_cast<const UnOp*>(next.node);
+                node.data = unOp->op;
+                pending.push_back({unOp->expr, index, Field::Lhs});
+                break;
+            }
+            case NodeKind::IndexExpr: {
+                auto indexExpr = static_cast<const IndexExpr*>(next.node);
+                node.data = indexExpr->sizeSpec;
+                pending.push_back({indexExpr->idx, index, Field::Rhs});
+                pending.push_back({indexExpr->array, index, Field::Lhs});
+                break;
+            }
+            case NodeKind::FunctionCall: {
+                auto funcCall = static_cast<const FunctionCall*>(next.node);
+                node.lhs = funcCall->ident->symbol;
+                node.extra = funcCall->paramList.size();
+                node.rhs = addList(funcCall->paramList);
+                break;
+            }
+            case NodeKind::Declaration: {
+                auto decl = static_cast<const Declaration*>(next.node);
+                node.data = (decl->isAuto ? DeclAuto : 0) | (decl->isRegister ? DeclRegister : 0);
+                node.lhs = decl->ident->symbol;
+                node.extra = decl->ident->slot;
+                pending.push_back({decl->expr, index, Field::Rhs});
+                break;
+            }
+            case NodeKind::WhileStatement: {
+                auto whileStmt = static_cast<const WhileStatement*>(next.node);
+                pending.push_back({whileStmt->statement, index, Field::Rhs});
+                pending.push_back({whileStmt->condition, index, Field::Lhs});
+                break;
+            }
+            case NodeKind::IfStatement: {
+                auto ifStmt = static_cast<const IfStatement*>(next.node);
+                node.extra = noNode;
+                if (ifStmt->elseStatement) {
+                    pending.push_back({*ifStmt->elseStatement, index, Field::Extra});
+                }
+                pending.push_back({ifStmt->statement, index, Field::Rhs});
+                pending.push_back({ifStmt->condition, index, Field::Lhs});
+                break;
+            }
+            case NodeKind::ExprStatement: {
+                pending.push_back({static_cast<const ExprStatement*>(next.node)->expr, index,
+                                   Field::Lhs});
+                break;
+            }
+            case NodeKind::ReturnStatement: {
+                auto returnStmt = static_cast<const ReturnStatement*>(next.node);
+                if (returnStmt->expr) {
+                    pending.push_back({*returnStmt->expr, index, Field::Lhs});
+                }
+                break;
+            }
+            case NodeKind::Block: {
+                auto block = static_cast<const Block*>(next.node);
+                node.extra = block->statements.size();
+                node.rhs = addList(block->statements);
+                break;
+            }
+        }
+    }
+
+    return rootIndex;
+}
+
+void FlatAST::appendStructure(size_t function, std::vector<uint64_t>& words) const {
+    const FlatFunction& flat = functions[function];
+    NodeIndex end = function + 1 < functions.size() ? functions[function + 1].body : nodes.size();
+
+    words.push_back(uint64_t(flat.paramCount) << 32 | flat.slotCount);
+    for (uint32_t i = 0; i < flat.autoDeclCount; i++) {
+        words.push_back(lists[flat.autoDecls + 2 * i]);
+    }
+
+    auto relative = [&](uint32_t child) { return child == noNode ? noNode : child - flat.body; };
+
+    for (NodeIndex index = flat.body; index < end; index++) {
+        const FlatNode& node = nodes[index];
+        words.push_back(uint64_t(node.kind) << 8 | node.data);
+
+        switch (node.kind) {
+            case NodeKind::Identifier: words.push_back(node.extra); break;
+            case NodeKind::IntLiteral: words.push_back(literal(node)); break;
+            case NodeKind::Declaration:
+                words.push_back(uint64_t(relative(node.rhs)) << 32 | node.extra);
+                break;
+            case NodeKind::FunctionCall:
+            case NodeKind::Block: {
+                if (node.kind == NodeKind::FunctionCall) {
+                    words.push_back(node.lhs);
+                }
+
+                words.push_back(node.extra);
+                for (uint32_t child : list(node.rhs, node.extra)) {
+                    words.push_back(relative(child));
+                }
+                break;
+            }
+            case NodeKind::IfStatement:
+                words.push_back(uint64_t(relative(node.lhs)) << 32 | relative(node.rhs));
+                words.push_back(relative(node.extra));
+                break;
+            default: words.push_back(uint64_t(relative(node.lhs)) << 32 | relative(node.rhs));
+        }
+    }
+}
+
+std::vector<uint32_t> FlatAST::findIdenticalFunctions() const {
+    std::vector<uint32_t> identical(functions.size());
+    std::unordered_multimap<uint64_t, uint32_t> byHash;
+    std::vector<uint64_t> words, otherWords;
+
+    for (uint32_t function = 0; function < functions.size(); function++) {
+        identical[function] = function;
+
+        words.clear();
+        appendStructure(function, words);
+
+        uint64_t hash = words.size();
+        for (uint64_t word : words) {
+            hash = (hash ^ word) * 0xBF58476D1CE4E5B9;
+            hash ^= hash >> 31;
+        }
+
+        // functions with equal hashes are compared, so a collision can not fold different ones
+        auto [first, last] = byHash.equal_range(hash);
+        for (auto it = first; it != last; ++it) {
+            otherWords.clear();
+            appendStructure(it->second, otherWords);
+
+            if (words == otherWords) {
+                identical[function] = it->second;
+                break;
+            }
+        }
+
+        if (identical[function] == function) {
+            byHash.emplace(hash, function);
+        }
+    }
+
+    return identical;
+}
+
+std::vector<bool> FlatAST::findReachableFunctions(std::span<const std::string> roots) const {
+    constexpr uint32_t undefined = std::numeric_limits<uint32_t>::max();
+
+    // the function defining each name
+    std::vector<uint32_t> definitions(nameCount(), undefined);
+    std::vector<bool> reachable(functions.size());
+    std::vector<uint32_t> worklist;
+
+    for (uint32_t function = 0; function < functions.size(); function++) {
+        definitions[functions[function].name] = function;
+
+        if (std::find(roots.begin(), roots.end(), name(functions[function].name)) != roots.end()) {
+            reachable[function] = true;
+            worklist.push_back(function);
+        }
+    }
+
+    std::vector<NodeIndex> pending;
+
+    while (!worklist.empty()) {
+        pending.push_back(functions[worklist.back()].body);
+        worklist.pop_back();
+
+        // only the nodes still reachable from the body, simplify() leaves others behind
+        while (!pending.empty()) {
+            const FlatNode& node = nodes[pending.back()];
+            pending.pop_back();
+
+            if (node.kind == NodeKind::FunctionCall) {
+                uint32_t callee = definitions[node.lhs];
+
+                if (callee != undefined && !reachable[callee]) {
+                    reachable[callee] = true;
+                    worklist.push_back(callee);
+                }
+            }
+
+            forEachChild(node, [&](NodeIndex child) { pending.push_back(child); });
+        }
+    }
+
+    return reachable;
+}
+
+void FlatAST::simplify() {
+    if (nodes.data() != nodeStorage.data()) {
+        nodeStorage.assign(nodes.begin(), nodes.end());
+        literalStorage.assign(literals.begin(), literals.end());
+        listStorage.assign(lists.begin(), lists.end());
+        functionStorage.assign(functions.begin(), functions.end());
+        updateViews();
+    }
+
+    std::vector<bool> isAuto;
+
+    for (size_t f = 0; f < functions.size(); f++) {
+        const FlatFunction& function = functions[f];
+        NodeIndex end = f + 1 < functions.size() ? functions[f + 1].body : nodes.size();
+
+        isAuto.assign(function.slotCount, false);
+        for (uint32_t i = 0; i < function.autoDeclCount; i++) {
+            isAuto[lists[function.autoDecls + 2 * i]] = true;
+        }
+
+        // children come after their parent, going backwards simplifies them first
+        for (NodeIndex index = end; index-- > function.body;) {
+            simplifyNode(index, isAuto);
+        }
+    }
+
+    updateViews();
+}
+
+// A node is rewritten in place, with a copy of the child that replaces it or a new kind. The
+// nodes it no longer refers to stay in the array, unreachable.
+void FlatAST::simplifyNode(NodeIndex index, const std::vector<bool>& isAuto) {
+    FlatNode& node = nodeStorage[index];
+
+    auto literalOf = [&](uint32_t child) -> std::optional<uint64_t> {
+        if (nodeStorage[child].kind != NodeKind::IntLiteral) {
+            return std::nullopt;
+        }
+
+        return literalStorage[nodeStorage[child].lhs];
+    };
+
+    auto setLiteral = [&](uint64_t value) {
+        node = FlatNode{NodeKind::IntLiteral};
+        node.lhs = literalStorage.size();
+        literalStorage.push_back(value);
+    };
+
+    // Code generation yields the address of autos and of indexed elements, which not every
+    // user of a value loads. They only replace an operation that yields a value where that is
+    // the same.
+    auto replaceBy = [&](uint32_t child) {
+        const FlatNode& replacement = nodeStorage[child];
+        bool isAddress = (replacement.kind == NodeKind::Identifier && isAuto[replacement.extra]) ||
+                         replacement.kind == NodeKind::IndexExpr;
+
+        if (!isAddress) {
+            node = replacement;
+        }
+    };
+
+    // conditions only test for zero, like !!x does
+    auto stripDoubleNot = [&](uint32_t& condition) {
+        auto isNot = [&](uint32_t expr) {
+            return nodeStorage[expr].kind == NodeKind::UnOp && nodeStorage[expr].data == OpNot;
+        };
+
+        while (isNot(condition) && isNot(nodeStorage[condition].lhs)) {
+            condition = nodeStorage[nodeStorage[condition].lhs].lhs;
+        }
+    };
+
+    auto setEmptyBlock = [&] {
+        node = FlatNode{NodeKind::Block};
+        node.rhs = 0;
+    };
+
+    switch (node.kind) {
+        case NodeKind::UnOp: {
+            std::optional<uint64_t> value = literalOf(node.lhs);
+
+            if (value && node.data == OpMinus) {
+                setLiteral(-*value);
+            } else if (value && node.data == OpBitNot) {
+                setLiteral(~*value);
+            } else if (value && node.data == OpNot) {
+                setLiteral(*value == 0);
+            }
+            break;
+        }
+        case NodeKind::BinOp: {
+            TokenType op = TokenType(node.data);
+            std::optional<uint64_t> left = literalOf(node.lhs);
+            std::optional<uint64_t> right = literalOf(node.rhs);
+
+            if (op == OpAssign) {
+                break;
+            }
+
+            if (left && right) {
+                if (std::optional<uint64_t> value = foldBinOp(op, *left, *right)) {
+                    setLiteral(*value);
+                }
+                break;
+            }
+
+            // the right side of && and || is not evaluated if the left side decides the result
+            if (left && (op == OpLogicalAnd || op == OpLogicalOr)) {
+                if ((*left != 0) == (op == OpLogicalOr)) {
+                    setLiteral(op == OpLogicalOr);
+                }
+                break;
+            }
+
+            std::optional<uint64_t> constant = left ? left : right;
+            uint32_t constantNode = left ? node.lhs : node.rhs;
+            uint32_t other = left ? node.rhs : node.lhs;
+
+            if (!constant) {
+                break;
+            }
+
+            // x + 0, x * 1 and the like are x
+            bool isIdentity =
+                *constant == 0 ? op == OpPlus || op == OpOr || op == OpXor ||
+                                     (right && (op == OpMinus || op == OpShiftLeft ||
+                                                op == OpShiftRight))
+                               : *constant == 1 && (op == OpMultiply || (right && op == OpDivide));
+
+            if (isIdentity) {
+                replaceBy(other);
+            } else if (op == OpMultiply && *constant > 1 && (*constant & (*constant - 1)) == 0) {
+                // the literal node becomes the shift amount
+                literalStorage[nodeStorage[constantNode].lhs] = __builtin_ctzll(*constant);
+                node.data = OpShiftLeft;
+                node.lhs = other;
+                node.rhs = constantNode;
+            }
+            break;
+        }
+        case NodeKind::IfStatement: {
+            stripDoubleNot(node.lhs);
+
+            if (std::optional<uint64_t> condition = literalOf(node.lhs)) {
+                NodeIndex branch = *condition != 0 ? node.rhs : node.extra;
+
+                if (branch == noNode) {
+                    setEmptyBlock();
+                } else {
+                    node = nodeStorage[branch];
+                }
+            }
+            break;
+        }
+        case NodeKind::WhileStatement: {
+            stripDoubleNot(node.lhs);
+
+            if (literalOf(node.lhs) == 0) {
+                setEmptyBlock();
+            }
+            break;
+        }
+        default: break;
+    }
+}
+
+void FlatAST::inlineCalls() {
+    // callees whose return expression has more nodes are not inlined, nor calls whose expression
+    // would grow beyond maxInlinedNodes with the arguments substituted
+    constexpr uint32_t maxCalleeNodes = 16;
+    constexpr uint32_t maxInlinedNodes = 64;
+    constexpr uint32_t undefined = std::numeric_limits<uint32_t>::max();
+    constexpr uint32_t notInlinable = undefined - 1;
+
+    std::vector<NodeIndex> walk;
+
+    // by name, the return expression of every function whose body only returns a small
+    // expression of its parameters, and the parameter count of all functions
+    std::vector<NodeIndex> returnExpressions(nameCount(), noNode);
+    std::vector<uint32_t> paramCounts(nameCount(), undefined);
+
+    // Nodes of the subtree of root, or maxInlinedNodes + 1 if it is larger, assigns or calls
+    // functions that are not inlined. Those functions have no side effects.
+    auto pureSize = [&](NodeIndex root) {
+        uint32_t size = 0;
+        walk.assign(1, root);
+
+        while (!walk.empty() && size <= maxInlinedNodes) {
+            const FlatNode& node = nodes[walk.back()];
+            walk.pop_back();
+
+            if ((node.kind == NodeKind::FunctionCall &&
+                 (returnExpressions[node.lhs] == noNode || paramCounts[node.lhs] != node.extra)) ||
+                (node.kind == NodeKind::BinOp && node.data == OpAssign)) {
+                return maxInlinedNodes + 1;
+            }
+
+            size++;
+            forEachChild(node, [&](NodeIndex child) { walk.push_back(child); });
+        }
+
+        return walk.empty() ? size : maxInlinedNodes + 1;
+    };
+
+    for (const FlatFunction& function : functions) {
+        const FlatNode& body = nodes[function.body];
+        const FlatNode* statement = body.extra == 1 ? &nodes[list(body.rhs, 1)[0]] : nullptr;
+
+        if (paramCounts[function.name] != undefined || !statement ||
+            statement->kind != NodeKind::ReturnStatement || statement->lhs == noNode ||
+            pureSize(statement->lhs) > maxCalleeNodes) {
+            paramCounts[function.name] = notInlinable;
+            continue;
+        }
+
+        // no calls, only parameters and the address of a parameter is not taken
+        bool isInlinable = true;
+        walk.assign(1, statement->lhs);
+
+        while (!walk.empty()) {
+            const FlatNode& node = nodes[walk.back()];
+            walk.pop_back();
+
+            if (node.kind == NodeKind::FunctionCall ||
+                (node.kind == NodeKind::Identifier && node.extra >= function.paramCount) ||
+                (node.kind == NodeKind::UnOp && node.data == OpAmp)) {
+                isInlinable = false;
+            }
+
+            forEachChild(node, [&](NodeIndex child) { walk.push_back(child); });
+        }
+
+        paramCounts[function.name] = isInlinable ? function.paramCount : notInlinable;
+        if (isInlinable) {
+            returnExpressions[function.name] = statement->lhs;
+        }
+    }
+
+    std::vector<bool> isAuto;
+    std::vector<uint32_t> argSizes;
+
+    // Arguments are evaluated as often and in the order their parameters are used, so they may
+    // not have side effects. They also have to be values like parameters are, autos and indexed
+    // elements yield addresses. For the same reason an indexed element is only inlined where its
+    // address is loaded, which arguments and arrays being indexed are not.
+    auto canInline = [&](const FlatNode& call, bool isLoaded) {
+        NodeIndex expression = returnExpressions[call.lhs];
+        if (expression == noNode || paramCounts[call.lhs] != call.extra ||
+            (!isLoaded && nodes[expression].kind == NodeKind::IndexExpr)) {
+            return false;
+        }
+
+        argSizes.clear();
+        for (NodeIndex arg : list(call.rhs, call.extra)) {
+            const FlatNode& node = nodes[arg];
+            if ((node.kind == NodeKind::Identifier && isAuto[node.extra]) ||
+                node.kind == NodeKind::IndexExpr) {
+                return false;
+            }
+
+            // also if the parameter is not used, the argument would not be evaluated
+            argSizes.push_back(pureSize(arg));
+            if (argSizes.back() > maxInlinedNodes) {
+                return false;
+            }
+        }
+
+        uint32_t size = 0;
+        walk.assign(1, expression);
+
+        while (!walk.empty()) {
+            const FlatNode& node = nodes[walk.back()];
+            walk.pop_back();
+
+            size += node.kind == NodeKind::Identifier ? argSizes[node.extra] : 1;
+            forEachChild(node, [&](NodeIndex child) { walk.push_back(child); });
+        }
+
+        return size <= maxInlinedNodes;
+    };
+
+    // the tree is copied function by function into new arrays, in pre-order like addNodes()
+    enum class Field : uint8_t { Lhs, Rhs, Extra, List };
+
+    struct Pending {
+        NodeIndex source;
+        uint32_t owner;  // parent node or list slot in the new arrays, noNode for a body
+        Field field;
+        NodeIndex call = noNode;  // within the return expression inlined for this call
+        bool isLoaded = true;     // an address in its place would be loaded by the parent
+    };
+
+    std::vector<FlatNode> newNodes;
+    std::vector<uint64_t> newLiterals;
+    std::vector<uint32_t> newLists;
+    std::vector<FlatFunction> newFunctions;
+    std::vector<Pending> pending;
+
+    newNodes.reserve(nodes.size());
+    newLiterals.reserve(literals.size());
+    newLists.reserve(lists.size());
+
+    for (const FlatFunction& function : functions) {
+        FlatFunction& copy = newFunctions.emplace_back(function);
+
+        copy.params = newLists.size();
+        newLists.insert(newLists.end(), lists.begin() + function.params,
+                        lists.begin() + function.params + function.paramCount);
+        copy.autoDecls = newLists.size();
+        newLists.insert(newLists.end(), lists.begin() + function.autoDecls,
+                        lists.begin() + function.autoDecls + 2 * function.autoDeclCount);
+
+        isAuto.assign(function.slotCount, false);
+        for (uint32_t i = 0; i < function.autoDeclCount; i++) {
+            isAuto[lists[function.autoDecls + 2 * i]] = true;
+        }
+
+        copy.body = newNodes.size();
+        pending.push_back({function.body, noNode, Field::Lhs});
+
+        while (!pending.empty()) {
+            Pending next = pending.back();
+            pending.pop_back();
+
+            // Parameters of an inlined function are replaced by the arguments of the call, which
+            // may be inlined calls in turn. Either step descends into the caller's tree.
+            while (true) {
+                const FlatNode& source = nodes[next.source];
+
+                if (next.call != noNode && source.kind == NodeKind::Identifier) {
+                    const FlatNode& call = nodes[next.call];
+                    next.source = list(call.rhs, call.extra)[source.extra];
+                    next.call = noNode;
+                } else if (next.call == noNode && source.kind == NodeKind::FunctionCall &&
+                           canInline(source, next.isLoaded)) {
+                    next.call = next.source;
+                    next.source = returnExpressions[source.lhs];
+                } else {
+                    break;
+                }
+            }
+
+            NodeIndex index = newNodes.size();
+            if (next.owner != noNode) {
+                switch (next.field) {
+                    case Field::Lhs: newNodes[next.owner].lhs = index; break;
+                    case Field::Rhs: newNodes[next.owner].rhs = index; break;
+                    case Field::Extra: newNodes[next.owner].extra = index; break;
+                    case Field::List: newLists[next.owner] = index; break;
+                }
+            }
+
+            const FlatNode& source = nodes[next.source];
+            FlatNode& node = newNodes.emplace_back(source);
+
+            // children are pushed in reverse, so that the first child is laid out first
+            switch (source.kind) {
+                case NodeKind::IntLiteral:
+                    node.lhs = newLiterals.size();
+                    newLiterals.push_back(literals[source.lhs]);
+                    break;
+                case NodeKind::FunctionCall:
+                case NodeKind::Block: {
+                    node.rhs = newLists.size();
+                    newLists.resize(newLists.size() + source.extra);
+
+                    for (uint32_t i = source.extra; i-- > 0;) {
+                        pending.push_back({lists[source.rhs + i], node.rhs + i, Field::List,
+                                           next.call, source.kind == NodeKind::Block});
+                    }
+                    break;
+                }
+                case NodeKind::Identifier: break;
+                case NodeKind::Declaration:
+                    if (source.rhs != noNode) {
+                        pending.push_back({source.rhs, index, Field::Rhs, next.call});
+                    }
+                    break;
+                default:
+                    if (source.kind == NodeKind::IfStatement && source.extra != noNode) {
+                        pending.push_back({source.extra, index, Field::Extra, next.call});
+                    }
+                    if (source.rhs != noNode) {
+                        pending.push_back({source.rhs, index, Field::Rhs, next.call});
+                    }
+                    if (source.lhs != noNode) {
+                        pending.push_back({source.lhs, index, Field::Lhs, next.call,
+                                           source.kind != NodeKind::IndexExpr});
+                    }
+            }
+        }
+    }
+
+    nodeStorage = std::move(newNodes);
+    literalStorage = std::move(newLiterals);
+    listStorage = std::move(newLists);
+    functionStorage = std::move(newFunctions);
+    updateViews();
+}
@@ -0,0 +1,248 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "ast.hpp"
+#include "interner.hpp"
+#include "source.hpp"
+
+namespace clonk {
+
+using NodeIndex = uint32_t;
+
+constexpr NodeIndex noNode = std::numeric_limits<NodeIndex>::max();
+
+/**
+ * Node of a FlatAST. Children are indices into the node array, lists of statements and call
+ * parameters are ranges of FlatAST::lists. Variables are numbered per function, see
+ * Identifier::slot. Fields by kind:
+ *
+ *   kind              data        lhs             rhs             extra
+ *   Identifier                    symbol                          slot
+ *   IntLiteral                    literal index
+ *   BinOp             op          left            right
+ *   UnOp              op          operand
+ *   IndexExpr         size spec   array           index
+ *   FunctionCall                  symbol          first param     param count
+ *   Declaration       DeclFlags   symbol          value           slot
+ *   WhileStatement                condition       body
+ *   IfStatement                   condition       then            else or noNode
+ *   ExprStatement                 expression
+ *   ReturnStatement               value or noNode
+ *   Block                                         first stmt      statement count
+ */
+struct FlatNode {
+    NodeKind kind;
+    uint8_t data = 0;
+    uint16_t unused = 0;  // explicit padding, nodes are written to cache files as they are
+    uint32_t lhs = noNode;
+    uint32_t rhs = noNode;
+    uint32_t extra = 0;
+};
+
+static_assert(sizeof(FlatNode) == 16);
+
+struct FlatFunction {
+    SymbolId name;
+    uint32_t params;  // parameter symbols in FlatAST::lists, their slots are 0 to paramCount - 1
+    uint32_t paramCount;
+    uint32_t autoDecls;  // slot and symbol of every auto declaration in FlatAST::lists
+    uint32_t autoDeclCount;
+    uint32_t slotCount;
+    NodeIndex body;
+};
+
+/**
+ * The AST as a few flat arrays instead of a graph of nodes: nodes are laid out in pre-order, so
+ * a walk over a function reads its nodes front to back, and every node takes 16 bytes. Integer
+ * literals live in a side array, identifiers are only their SymbolId. Code generation reads
+ * this representation, the node graph only has to live until its functions are added.
+ *
+ * The arrays are read through spans, so that a tree loaded by ASTCache is used in place from
+ * the mapped file.
+ */
+class FlatAST {
+    // arrays of a tree built in memory
+    std::vector<FlatNode> nodeStorage;
+    std::vector<uint64_t> literalStorage;
+    std::vector<uint32_t> listStorage;
+    std::vector<FlatFunction> functionStorage;
+
+    // the arrays above, or sections of a mapped cache file
+    std::span<const FlatNode> nodes;
+    std::span<const uint64_t> literals;
+    std::span<const uint32_t> lists;  // child nodes of blocks and calls, symbols of functions
+    std::span<const FlatFunction> functions;
+
+    std::vector<std::pair<std::string, int>> externFunctions;  // name, paramcount
+
+    // kept alive for diagnostics and identifier names, like in AbstractSyntaxTree
+    std::shared_ptr<const SourceBuffer> source;
+    std::shared_ptr<const StringInterner> interner;
+
+    // names of a loaded tree, which has no interner: name i is nameChars[offsets[i], offsets[i+1])
+    std::shared_ptr<const SourceBuffer> cacheFile;
+    std::span<const uint32_t> nameOffsets;
+    const char* nameChars = nullptr;
+
+    friend class ASTCache;
+
+    FlatAST() = default;
+
+    NodeIndex addNodes(const Statement* root);
+
+    // Appends what makes up the body of functions[function] apart from names: node kinds,
+    // operators, literals, called functions and variable slots, with children relative to the
+    // body. Two functions append the same words exactly if they only differ in names.
+    void appendStructure(size_t function, std::vector<uint64_t>& words) const;
+
+    // isAuto tells for every slot of the function whether it is an auto variable
+    void simplifyNode(NodeIndex index, const std::vector<bool>& isAuto);
+
+    // Calls visit with every child of node, in the order code generation evaluates them
+    template <typename Visit>
+    void forEachChild(const FlatNode& node, Visit&& visit) const {
+        switch (node.kind) {
+            case NodeKind::Identifier:
+            case NodeKind::IntLiteral: break;
+            case NodeKind::FunctionCall:
+            case NodeKind::Block:
+                for (uint32_t element : list(node.rhs, node.extra)) {
+                    visit(element);
+                }
+                break;
+            case NodeKind::BinOp:
+            case NodeKind::IndexExpr:
+            case NodeKind::WhileStatement:
+                visit(node.lhs);
+                visit(node.rhs);
+                break;
+            case NodeKind::IfStatement:
+                visit(node.lhs);
+                visit(node.rhs);
+                if (node.extra != noNode) {
+                    visit(node.extra);
+                }
+                break;
+            case NodeKind::UnOp:
+            case NodeKind::ExprStatement:
+            case NodeKind::ReturnStatement:
+                if (node.lhs != noNode) {
+                    visit(node.lhs);
+                }
+                break;
+            case NodeKind::Declaration:
+                if (node.rhs != noNode) {
+                    visit(node.rhs);
+                }
+                break;
+        }
+    }
+
+    void updateViews() {
+        nodes = nodeStorage;
+        literals = literalStorage;
+        lists = listStorage;
+        functions = functionStorage;
+    }
+
+   public:
+    enum DeclFlags : uint8_t { DeclAuto = 1, DeclRegister = 2 };
+
+    FlatAST(std::shared_ptr<const SourceBuffer> source,
+            std::shared_ptr<const StringInterner> interner)
+        : source(std::move(source)), interner(std::move(interner)) {}
+
+    // Flattens all functions of ast
+    explicit FlatAST(const AbstractSyntaxTree& ast);
+
+    // the spans would point into the copied from tree
+    FlatAST(const FlatAST&) = delete;
+    FlatAST& operator=(const FlatAST&) = delete;
+    FlatAST(FlatAST&&) = default;
+    FlatAST& operator=(FlatAST&&) = default;
+
+    // Appends a copy of function, which may be freed afterwards
+    void addFunction(const Function& function);
+
+    // For every function whether it is one of the functions named in roots or called by them,
+    // directly or not. Calls that simplify() removed do not count.
+    std::vector<bool> findReachableFunctions(std::span<const std::string> roots) const;
+
+    // Replaces calls of functions that only return an expression without calls or assignments
+    // by that expression, with the arguments in place of the parameters. Calls are only inlined
+    // if their arguments are values without side effects and the expression stays small. The
+    // arrays are rebuilt, a tree loaded from a cache file ends up in memory.
+    void inlineCalls();
+
+    // Removes all functions of a tree built in memory, keeping the memory of the arrays
+    void clear() {
+        nodeStorage.clear();
+        literalStorage.clear();
+        listStorage.clear();
+        functionStorage.clear();
+        updateViews();
+    }
+
+    // Folds constant expressions, rewrites identities like x + 0, x * 1 and x * 2^k to x << k,
+    // drops !! from conditions and replaces if and while statements whose condition is constant
+    // by the code that runs, so that less of the tree reaches code generation. Results are the
+    // same as without, a tree loaded from a cache file is copied into memory first.
+    void simplify();
+
+    void addExternFunction(std::string name, int paramCount) {
+        externFunctions.emplace_back(std::move(name), paramCount);
+    }
+
+    const FlatNode& node(NodeIndex index) const { return nodes[index]; }
+
+    uint64_t literal(const FlatNode& node) const { return literals[node.lhs]; }
+
+    std::span<const uint32_t> list(uint32_t first, uint32_t count) const {
+        return lists.subspan(first, count);
+    }
+
+    std::string_view name(SymbolId symbol) const {
+        if (interner) {
+            return interner->name(symbol);
+        }
+
+        return {nameChars + nameOffsets[symbol], nameOffsets[symbol + 1] - nameOffsets[symbol]};
+    }
+
+    // number of distinct names, valid SymbolIds are below
+    size_t nameCount() const {
+        return interner ? interner->size() : nameOffsets.size() - 1;
+    }
+
+    std::span<const FlatFunction> getFunctions() const { return functions; }
+
+    // For every function the index of the first function with the same body up to the names of
+    // its parameters and variables, its own index if no function before it has that body
+    std::vector<uint32_t> findIdenticalFunctions() const;
+
+    const std::vector<std::pair<std::string, int>>& getExternFunctions() const {
+        return externFunctions;
+    }
+
+    // Source text, nullptr for a tree loaded from a cache file
+    const std::shared_ptr<const SourceBuffer>& getSource() const { return source; }
+
+    size_t nodeCount() const { return nodes.size(); }
+
+    // bytes reserved by the arrays
+    size_t memoryUsage() const {
+        return nodeStorage.capacity() * sizeof(FlatNode) +
+               literalStorage.capacity() * sizeof(uint64_t) +
+               listStorage.capacity() * sizeof(uint32_t) +
+               functionStorage.capacity() * sizeof(FlatFunction);
+    }
+};
+
+}  // end namespace clonk
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace clonk {
+
+using SymbolId = uint32_t;
+
+// An interned identifier: dense id and the name, which is owned by the interner
+struct Symbol {
+    SymbolId id;
+    std::string_view name;
+};
+
+/**
+ * Maps every distinct identifier to a dense 32 bit id. Names are copied into chunked storage
+ * owned by the interner, so they stay valid independent of the program text.
+ * Lookups go through an open addressing table with a word-at-a-time hash, since this is done
+ * for every identifier token.
+ */
+class StringInterner {
+    static constexpr size_t chunkSize = 1 << 16;
+    static constexpr SymbolId emptySlot = ~SymbolId(0);
+
+    std::vector<SymbolId> table = std::vector<SymbolId>(1024, emptySlot);
+    std::vector<std::string_view> names;
+    std::vector<uint64_t> hashes;  // per symbol, avoids rehashing when growing
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char* current = nullptr;
+    size_t remaining = 0;
+
+    std::string_view store(std::string_view name) {
+        if (name.size() > remaining) {
+            if (name.size() > chunkSize / 4) {
+                // oversized names get their own allocation
+                chunks.push_back(std::make_unique<char[]>(name.size()));
+                std::memcpy(chunks.back().get(), name.data(), name.size());
+                return {chunks.back().get(), name.size()};
+            }
+
+            chunks.push_back(std::make_unique<char[]>(chunkSize));
+            current = chunks.back().get();
+            remaining = chunkSize;
+        }
+
+        char* data = current;
+        std::memcpy(data, name.data(), name.size());
+        current += name.size();
+        remaining -= name.size();
+        return {data, name.size()};
+    }
+
+    static uint64_t hash(std::string_view name) {
+        uint64_t h = 0x9E3779B97F4A7C15 ^ name.size();
+        size_t i = 0;
+
+        for (; i + 8 <= name.size(); i += 8) {
+            uint64_t word;
+            std::memcpy(&word, name.data() + i, sizeof(word));
+            h = (h ^ word) * 0xBF58476D1CE4E5B9;
+            h ^= h >> 31;
+        }
+
+        uint64_t tail = 0;
+        std::memcpy(&tail, name.data() + i, name.size() - i);
+        h = (h ^ tail) * 0x94D049BB133111EB;
+        return h ^ (h >> 29);
+    }
+
+    // slot of name in the table, or of the empty slot it would be inserted at
+    size_t findSlot(std::string_view name, uint64_t h) const {
+        size_t mask = table.size() - 1;
+        size_t slot = h & mask;
+
+        while (table[slot] != emptySlot) {
+            SymbolId id = table[slot];
+            if (hashes[id] == h && names[id] == name) {
+                return slot;
+            }
+
+            slot = (slot + 1) & mask;
+        }
+
+        return slot;
+    }
+
+    void grow() {
+        std::vector<SymbolId> old(table.size() * 2, emptySlot);
+        table.swap(old);
+
+        size_t mask = table.size() - 1;
+        for (SymbolId id = 0; id < names.size(); id++) {
+            size_t slot = hashes[id] & mask;
+            while (table[slot] != emptySlot) {
+                slot = (slot + 1) & mask;
+            }
+
+            table[slot] = id;
+        }
+    }
+
+   public:
+    Symbol intern(std::string_view name) {
+        uint64_t h = hash(name);
+        size_t slot = findSlot(name, h);
+
+        if (table[slot] != emptySlot) {
+            return {table[slot], names[table[slot]]};
+        }
+
+        SymbolId id = names.size();
+        std::string_view stored = store(name);
+        names.push_back(stored);
+        hashes.push_back(h);
+        table[slot] = id;
+
+        if (names.size() * 2 > table.size()) {
+            grow();
+        }
+
+        return {id, stored};
+    }
+
+    // Looks up a name without interning it
+    std::optional<Symbol> find(std::string_view name) const {
+        size_t slot = findSlot(name, hash(name));
+        if (table[slot] == emptySlot) {
+            return std::nullopt;
+        }
+
+        return Symbol{table[slot], names[table[slot]]};
+    }
+
+    std::string_view name(SymbolId id) const { return names[id]; }
+
+    size_t size() const { return names.size(); }
+};
+
+}  // end namespace clonk
@@ -1,11 +1,14 @@
+#include <algorithm>
+#include <bit>
 #include <cctype>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <optional>
 #include <stdexcept>
 #include <string>
-#include <unordered_map>
 
+#include "debug.hpp"
 #include "diagnostics.hpp"
 #include "lexer.hpp"
 
@@ -58,18 +61,12 @@ std::string Token::to_string() const {
         case SizeSpec: return "@";
         case Comma: return ",";
         case EndOfStatement: return ";";
-        default: opToString(this->type);
+        default: return opToString(this->type);
     }
 
     return "";
 }
 
-const std::unordered_map<std::string_view, TokenType> keywords = {
-    {"auto", TokenType::KeyAuto},         {"return", TokenType::KeyReturn},
-    {"register", TokenType::KeyRegister}, {"if", TokenType::KeyIf},
-    {"else", TokenType::KeyElse},         {"while", TokenType::KeyWhile},
-};
-
 enum CharType {
     X,  // None
     A,  // Alphabetical char or underscore
@@ -92,88 +89,351 @@ inline CharType lookupChar(unsigned char c) {
 }
 
 inline bool isBaseChar(char c) {
-    return std::isalnum(c) || c == '_';
+    CharType type = lookupChar(c);
+    return type == CharType::A || type == CharType::N;
+}
+
+TokenStream::~TokenStream() {
+    if (lexerThread.joinable()) {
+        stopLexer.store(true, std::memory_order_relaxed);
+        lexerThread.join();
+    }
+}
+
+bool TokenStream::tokenizeUntil(size_t end) {
+    assert(!top && "cannot switch to buffered mode after peeking");
+
+    if (stream || pipeline || input.size() > UINT32_MAX) {
+        return false;
+    }
+
+    TokenBuffer tokens;
+    lexBuffer = &tokens;
+
+    // the token at end is kept, its offset is the one of the end of file
+    while (true) {
+        Token token = lex();
+        tokens.push(token);
+
+        if (token.type == TokenType::EndOfFile || token.offset >= end) {
+            break;
+        }
+    }
+
+    lexBuffer = nullptr;
+    tokens.shrinkToFit();
+    bufferEnd = tokens.size() - 1;
+    buffer = std::make_shared<const TokenBuffer>(std::move(tokens));
+    cursor = 0;
+    return buffer->offset(bufferEnd) == end;
+}
+
+TokenStream::TokenStream(const TokenStream& whole, size_t firstToken, size_t endToken)
+    : source(whole.source),
+      input(whole.input),
+      kernels(whole.kernels),
+      interner(whole.interner),
+      locations(whole.locations),
+      buffer(whole.buffer),
+      cursor(firstToken),
+      bufferEnd(endToken),
+      isRange(true) {
+    assert(buffer && firstToken <= endToken && endToken <= whole.bufferEnd);
+
+    // diagnostics before the range are reported by the stream reading the range before
+    const std::vector<LexerDiagnostics::Error>& errors = buffer->diagnostics.errors;
+    reportedErrors = std::partition_point(errors.begin(), errors.end(),
+                                          [firstToken](const LexerDiagnostics::Error& error) {
+                                              return error.token < firstToken;
+                                          }) -
+                     errors.begin();
+}
+
+std::vector<size_t> TokenStream::splitFunctions(size_t parts) const {
+    assert(buffer && "splitting requires a tokenized stream");
+
+    std::vector<size_t> bounds = {cursor};
+    size_t tokens = bufferEnd - cursor;
+    size_t nextPart = 1;
+    int64_t depth = 0;
+
+    for (size_t idx = cursor; idx < bufferEnd && nextPart < parts; idx++) {
+        TokenType type = buffer->type(idx);
+
+        if (type == TokenType::BraceL) {
+            depth++;
+
+        } else if (type == TokenType::BraceR && --depth == 0) {
+            // a function ends here, split if the current range is large enough
+            size_t boundary = idx + 1;
+            if (boundary >= cursor + tokens * nextPart / parts && boundary < bufferEnd) {
+                bounds.push_back(boundary);
+
+                while (nextPart < parts && cursor + tokens * nextPart / parts <= boundary) {
+                    nextPart++;
+                }
+            }
+        }
+    }
+
+    bounds.push_back(bufferEnd);
+    return bounds;
+}
+
+bool TokenStream::startLexerThread() {
+    if (stream || buffer || pipeline || top || input.size() > UINT32_MAX) {
+        return false;
+    }
+
+    pipeline = std::make_unique<SPSCQueue<TokenBatch, 16>>();
+    lexerThread = std::thread(&TokenStream::runLexerThread, this);
+    return true;
+}
+
+void TokenStream::runLexerThread() {
+    bool done = false;
+
+    while (!done) {
+        TokenBatch* batch;
+        while (!(batch = pipeline->acquireWrite())) {
+            if (stopLexer.load(std::memory_order_relaxed)) {
+                return;
+            }
+
+            std::this_thread::yield();
+        }
+
+        batch->tokens.clear();
+        batch->diagnostics.clear();
+        lexBatch = batch;
+
+        while (batch->tokens.size() < batchSize) {
+            batch->tokens.push_back(lex());
+
+            if (batch->tokens.back().type == TokenType::EndOfFile) {
+                done = true;
+                break;
+            }
+        }
+
+        pipeline->publish();
+    }
+}
+
+const TokenStream::TokenBatch& TokenStream::currentBatch() {
+    if (readBatch && batchCursor < readBatch->tokens.size()) {
+        if (batchCursor >= nextDiagnostic) {
+            reportLexerDiagnostics(readBatch->diagnostics, batchCursor, readBatch->tokens.size());
+        }
+
+        return *readBatch;
+    }
+
+    if (readBatch) {
+        pipeline->release();
+    }
+
+    while (!(readBatch = pipeline->acquireRead())) {
+        std::this_thread::yield();
+    }
+
+    batchCursor = 0;
+    reportedErrors = 0;
+    reportLexerDiagnostics(readBatch->diagnostics, batchCursor, readBatch->tokens.size());
+
+    return *readBatch;
+}
+
+void TokenStream::reportLexerDiagnostics(const LexerDiagnostics& diagnostics, size_t cursor,
+                                         size_t end) {
+    const std::vector<LexerDiagnostics::Error>& errors = diagnostics.errors;
+
+    while (reportedErrors < errors.size() && errors[reportedErrors].token <= cursor &&
+           errors[reportedErrors].token < end) {
+        const LexerDiagnostics::Error& error = errors[reportedErrors++];
+        DiagnosticsManager::get().error(*this, error.offset, error.message);
+    }
+
+    const std::optional<LexerDiagnostics::UnknownToken>& unknown = diagnostics.unknownToken;
+
+    if (reportedErrors < errors.size() && errors[reportedErrors].token < end) {
+        nextDiagnostic = errors[reportedErrors].token;
+
+    } else if (unknown && unknown->token <= end && cursor < unknown->token) {
+        nextDiagnostic = unknown->token;
+
+    } else {
+        nextDiagnostic = SIZE_MAX;
+
+        if (!unknown || unknown->token > end) {
+            return;
+        } else if (isRange) {
+            DiagnosticsManager::get().error(*this, unknown->offset, "Unknown token");
+        } else {
+            DiagnosticsManager::get().unknownToken(*this, unknown->offset);
+        }
+    }
 }
 
 Token TokenStream::next() {
-    if (top) {
-        Token token = top.value();
-        top = std::nullopt;
+    if (pipeline) {
+        const TokenBatch& batch = currentBatch();
+        Token token = batch.tokens[batchCursor];
+        lastOffset = token.offset;
+
+        // the end of file token is the last one the lexer thread produces, stay on it
+        if (token.type != TokenType::EndOfFile) {
+            batchCursor++;
+        }
+
         return token;
     }
 
-    char c = moveToNextToken();
-    if (position >= input.size() || c == 0) {
-        return Token(TokenType::EndOfFile);
-    }
-
-    CharType charType = lookupChar(c);
-    switch (charType) {
-        case CharType::A: return lexWord();
-        case CharType::N: return lexNumber();
-        case CharType::O: return lexOperator();
-        case CharType::P: return lexPunctuationChar();
-        default: {
-            position++;
-            DiagnosticsManager::get().unknownToken(*this);
-            exit(EXIT_FAILURE);
+    if (buffer) {
+        Token token = peek();
+        lastOffset = token.offset;
+
+        if (cursor < bufferEnd) {
+            cursor++;
         }
+
+        return token;
     }
+
+    Token token = top ? top.value() : lex();
+    top = std::nullopt;
+    lastOffset = token.offset;
+    return token;
 }
 
 Token TokenStream::peek() {
-    if (top) {
-        return top.value();
+    if (pipeline) {
+        return currentBatch().tokens[batchCursor];
+    }
+
+    if (buffer) {
+        if (cursor >= nextDiagnostic) {
+            reportLexerDiagnostics(buffer->diagnostics, cursor, bufferEnd);
+        }
+
+        if (cursor < bufferEnd) {
+            return buffer->get(cursor, *interner);
+        }
+
+        Token token(TokenType::EndOfFile);
+        token.offset = buffer->offset(bufferEnd);
+        return token;
+    }
+
+    if (!top) {
+        top = lex();
     }
 
-    Token next = this->next();
-    this->top = std::make_optional<Token>(next);
-    return next;
+    return top.value();
 }
 
 bool TokenStream::empty() {
-    return this->peek().type == TokenType::EndOfFile;
+    return this->peekType() == TokenType::EndOfFile;
 }
 
-char TokenStream::moveToNextToken() {
-    while (position < input.size()) {
-        char c = input[position];
+Token TokenStream::lex() {
+    char c = moveToNextToken();
+    size_t lexerOffset = getLexerOffset();
+    uint32_t offset = lexerOffset;
 
-        if (c == '/' && position + 1 < input.size()) {
-            if (input[++position] == '/') {
+    // offsets of tokens wrap around past 4 GiB, only streams and lazily lexed files get there
+    if (lexerOffset > UINT32_MAX && !offsetsWrapped) {
+        offsetsWrapped = true;
+        logger::warn("Input larger than 4 GiB, locations of errors after it are not reliable\n");
+    }
 
-                // skip comment
-                while (position < input.size() && input[position] != '\n') {
-                    position++;
-                }
+    if (position >= input.size() || c == 0) {
+        Token token(TokenType::EndOfFile);
+        token.offset = offset;
+        return token;
+    }
 
-                if (position >= input.size()) {
-                    return 0;
-                }
+    Token token = [&]() -> Token {
+        switch (lookupChar(c)) {
+            case CharType::A: return lexWord();
+            case CharType::N: return lexNumber();
+            case CharType::O: return lexOperator();
+            case CharType::P: return lexPunctuationChar();
+            default: return lexUnknownToken();
+        }
+    }();
 
-                position++;
-                lineStart = position;
-                line++;
+    token.offset = offset;
+    return token;
+}
+
+void TokenStream::lexError(size_t offset, const std::string& message) {
+    // the token being lexed is pushed once lex() returns
+    if (lexBatch) {
+        lexBatch->diagnostics.errors.push_back({lexBatch->tokens.size(), offset, message});
+    } else if (lexBuffer) {
+        lexBuffer->diagnostics.errors.push_back({lexBuffer->size(), offset, message});
+    } else {
+        DiagnosticsManager::get().error(*this, offset, message);
+    }
+}
+
+Token TokenStream::lexUnknownToken() {
+    size_t offset = getLexerOffset();
+
+    if (lexBatch) {
+        lexBatch->diagnostics.unknownToken = {lexBatch->tokens.size(), offset};
+    } else if (lexBuffer) {
+        lexBuffer->diagnostics.unknownToken = {lexBuffer->size(), offset};
+    } else {
+        DiagnosticsManager::get().unknownToken(*this, offset);
+        exit(EXIT_FAILURE);
+    }
+
+    return Token(TokenType::EndOfFile);
+}
+
+bool TokenStream::refill() {
+    if (!stream) {
+        return false;
+    }
+
+    // windows end with a newline, so the new window starts at the beginning of a line
+    input = stream->advance(input.size());
+    position = 0;
+    locations->addWindow(input, stream->offset());
+    return !input.empty();
+}
 
+char TokenStream::moveToNextToken() {
+    while (true) {
+        position = kernels.skipWhitespace(input, position);
+
+        if (position >= input.size()) {
+            if (refill()) {
                 continue;
             }
+
+            return 0;
         }
 
-        // check whitespace
-        if (std::isspace(c)) {
-            if (c == '\n') {
-                line++;
-                lineStart = position;
-            }
+        if (input[position] != '/' || position + 1 >= input.size() || input[position + 1] != '/') {
+            return input[position];
+        }
 
-            position++;
+        // skip comment including the terminating newline
+        position = kernels.findNewline(input, position + 2);
 
-        } else {
-            return c;
+        if (position >= input.size()) {
+            if (refill()) {
+                continue;
+            }
+
+            return 0;
         }
-    }
 
-    return 0;
+        position++;
+    }
 }
 
 Token TokenStream::lexOperator() {
@@ -255,8 +515,8 @@ Token TokenStream::lexOperator() {
     position++;
 
     if (!op.has_value()) {
-        DiagnosticsManager::get().unknownToken(*this);
-        exit(EXIT_FAILURE);
+        position--;
+        return lexUnknownToken();
 
     } else {
         return {op.value()};
@@ -271,23 +531,60 @@ Token TokenStream::lexWord() {
     }
 
     std::string_view lexeme = input.substr(start, position - start);
+    TokenType type = classifyWord(lexeme);
 
-    if (keywords.find(lexeme) != keywords.end()) {
-        return {keywords.at(lexeme)};
+    if (type != TokenType::IdentifierType) {
+        return {type};
     }
 
-    return {TokenType::IdentifierType, lexeme};
+    return {TokenType::IdentifierType, interner->intern(lexeme)};
+}
+
+// true if all eight bytes of chunk are ASCII digits
+static inline bool isEightDigits(uint64_t chunk) {
+    return ((chunk & 0xF0F0F0F0F0F0F0F0) |
+            (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) == 0x3333333333333333;
+}
+
+// converts eight ASCII digits (first digit in the lowest byte) with three multiplications
+static inline uint64_t parseEightDigits(uint64_t chunk) {
+    chunk &= 0x0F0F0F0F0F0F0F0F;
+    chunk = ((chunk * (1 + (10 << 8))) >> 8) & 0x00FF00FF00FF00FF;
+    chunk = ((chunk * (1 + (100 << 16))) >> 16) & 0x0000FFFF0000FFFF;
+    return (chunk * (1 + (10000ULL << 32))) >> 32;
 }
 
 Token TokenStream::lexNumber() {
-    size_t start = position;
+    size_t start = getLexerOffset();
+    uint64_t value = 0;
+    bool overflow = false;
 
-    while (position < input.size() && std::isdigit(input[position])) {
+    if constexpr (std::endian::native == std::endian::little) {
+        while (position + 8 <= input.size()) {
+            uint64_t chunk;
+            std::memcpy(&chunk, input.data() + position, sizeof(chunk));
+
+            if (!isEightDigits(chunk)) {
+                break;
+            }
+
+            overflow |= __builtin_mul_overflow(value, 100000000, &value);
+            overflow |= __builtin_add_overflow(value, parseEightDigits(chunk), &value);
+            position += 8;
+        }
+    }
+
+    while (position < input.size() && lookupChar(input[position]) == CharType::N) {
+        overflow |= __builtin_mul_overflow(value, 10, &value);
+        overflow |= __builtin_add_overflow(value, input[position] - '0', &value);
         position++;
     }
 
-    return Token(TokenType::NumberLiteral,
-                 static_cast<uint64_t>(atoll(input.substr(start, position).cbegin())));
+    if (overflow) {
+        lexError(start, "integer literal out of range");
+    }
+
+    return Token(TokenType::NumberLiteral, value);
 }
 
 Token TokenStream::lexPunctuationChar() {
@@ -1,11 +1,21 @@
 #pragma once
 
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cstdint>
+#include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
 #include <variant>
+#include <vector>
+#include "interner.hpp"
+#include "queue.hpp"
+#include "scan.hpp"
+#include "source.hpp"
 
 namespace clonk {
 
@@ -59,11 +69,40 @@ enum TokenType {
 
 std::string opToString(TokenType op);
 
+// Maps a word to its keyword token type, or IdentifierType if it is not a keyword.
+// Dispatches on length and first char, so at most one comparison is done per word.
+constexpr TokenType classifyWord(std::string_view word) {
+    switch (word.size()) {
+        case 2: return word == "if" ? TokenType::KeyIf : TokenType::IdentifierType;
+        case 4: {
+            if (word[0] == 'a')
+                return word == "auto" ? TokenType::KeyAuto : TokenType::IdentifierType;
+            if (word[0] == 'e')
+                return word == "else" ? TokenType::KeyElse : TokenType::IdentifierType;
+            return TokenType::IdentifierType;
+        }
+        case 5: return word == "while" ? TokenType::KeyWhile : TokenType::IdentifierType;
+        case 6: return word == "return" ? TokenType::KeyReturn : TokenType::IdentifierType;
+        case 8: return word == "register" ? TokenType::KeyRegister : TokenType::IdentifierType;
+        default: return TokenType::IdentifierType;
+    }
+}
+
+static_assert(classifyWord("auto") == TokenType::KeyAuto);
+static_assert(classifyWord("register") == TokenType::KeyRegister);
+static_assert(classifyWord("if") == TokenType::KeyIf);
+static_assert(classifyWord("else") == TokenType::KeyElse);
+static_assert(classifyWord("while") == TokenType::KeyWhile);
+static_assert(classifyWord("return") == TokenType::KeyReturn);
+static_assert(classifyWord("elsa") == TokenType::IdentifierType);
+static_assert(classifyWord("i") == TokenType::IdentifierType);
+
 struct Token {
     TokenType type;
-    std::variant<std::monostate, std::string_view, uint64_t> data;
+    std::variant<std::monostate, Symbol, uint64_t> data;
+    uint32_t offset = 0;  // of the first character in the input, see SourceLocationIndex
 
-    Token(TokenType type, const std::string_view& identifier) : type(type), data(identifier) {
+    Token(TokenType type, Symbol identifier) : type(type), data(identifier) {
         assert(type == TokenType::IdentifierType);
     }
 
@@ -73,21 +112,24 @@ struct Token {
 
     Token(TokenType type) : type(type), data(std::monostate()) {}
 
-    Token(const Token& other) : type(other.type), data(other.data) {}
+    Token(const Token& other) : type(other.type), data(other.data), offset(other.offset) {}
 
     Token& operator=(const Token& other) {
         if (this != &other) {
             type = other.type;
             data = other.data;
+            offset = other.offset;
         }
         return *this;
     }
 
     ~Token() = default;
 
-    const std::string_view& getIdentifier() const {
+    std::string_view getIdentifier() const { return getSymbol().name; }
+
+    const Symbol& getSymbol() const {
         assert(type == TokenType::IdentifierType);
-        return std::get<std::string_view>(data);
+        return std::get<Symbol>(data);
     }
 
     uint64_t getValue() const {
@@ -98,33 +140,280 @@ struct Token {
     std::string to_string() const;
 };
 
+/**
+ * Diagnostics of the lexer for tokens lexed ahead of the parser, by tokenizeAll() or on the lexer
+ * thread. Each is recorded with the index of the token it was found at and raised once the parser
+ * reaches that token, so they are reported in the same order as when lexing on demand.
+ */
+struct LexerDiagnostics {
+    struct Error {
+        size_t token;
+        size_t offset;
+        std::string message;
+    };
+
+    // the tokens end with end of file at an unknown token
+    struct UnknownToken {
+        size_t token;
+        size_t offset;
+    };
+
+    std::vector<Error> errors;
+    std::optional<UnknownToken> unknownToken;
+
+    void clear() {
+        errors.clear();
+        unknownToken = std::nullopt;
+    }
+};
+
+/**
+ * Pre-lexed tokens of a whole file in struct-of-arrays layout. Every token is a type byte, the
+ * offset of its first character and a payload: the symbol id for identifiers, an index into the
+ * literal side table for number literals.
+ */
+class TokenBuffer {
+    std::vector<uint8_t> types;
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> payloads;
+
+    std::vector<uint64_t> literals;
+
+   public:
+    LexerDiagnostics diagnostics;
+
+    void push(const Token& token) {
+        uint32_t payload = 0;
+
+        if (token.type == TokenType::IdentifierType) {
+            payload = token.getSymbol().id;
+        } else if (token.type == TokenType::NumberLiteral) {
+            payload = literals.size();
+            literals.push_back(token.getValue());
+        }
+
+        types.push_back(token.type);
+        offsets.push_back(token.offset);
+        payloads.push_back(payload);
+    }
+
+    void shrinkToFit() {
+        types.shrink_to_fit();
+        offsets.shrink_to_fit();
+        payloads.shrink_to_fit();
+        literals.shrink_to_fit();
+    }
+
+    size_t size() const { return types.size(); }
+
+    TokenType type(size_t idx) const { return static_cast<TokenType>(types[idx]); }
+
+    uint32_t offset(size_t idx) const { return offsets[idx]; }
+
+    Token get(size_t idx, const StringInterner& interner) const {
+        Token token = [&]() -> Token {
+            switch (type(idx)) {
+                case TokenType::IdentifierType: {
+                    SymbolId id = payloads[idx];
+                    return {type(idx), Symbol{id, interner.name(id)}};
+                }
+                case TokenType::NumberLiteral: return {type(idx), literals[payloads[idx]]};
+                default: return {type(idx)};
+            }
+        }();
+
+        token.offset = offsets[idx];
+        return token;
+    }
+};
+
 class TokenStream {
+    std::shared_ptr<const SourceBuffer> source;  // keeps input alive, if owned by the stream
+    std::unique_ptr<ChunkedSource> stream;       // set when reading incrementally
     std::string_view input;
     size_t position = 0;
-    size_t line = 1;
-    size_t lineStart = 0;
+    size_t lastOffset = 0;  // of the token last returned by next()
     std::optional<Token> top = std::nullopt;
+    bool offsetsWrapped = false;  // lexed past 4 GiB, where token offsets no longer fit
+    const ScanKernels& kernels;
+    std::shared_ptr<StringInterner> interner = std::make_shared<StringInterner>();
+    std::shared_ptr<SourceLocationIndex> locations;
+
+    // set by tokenizeAll(), tokens are then read from the buffer by index. Tokens from bufferEnd
+    // on read as end of file, so a stream can cover a range of the tokens of another.
+    std::shared_ptr<const TokenBuffer> buffer;
+    size_t cursor = 0;
+    size_t bufferEnd = 0;
+    bool isRange = false;  // reads a range of the tokens of another stream, see splitFunctions()
+    TokenBuffer* lexBuffer = nullptr;  // being filled by tokenizeUntil()
+
+    // Tokens lexed ahead on the lexer thread. Its diagnostics are not raised concurrently but
+    // recorded with the tokens.
+    struct TokenBatch {
+        std::vector<Token> tokens;
+        LexerDiagnostics diagnostics;
+    };
+
+    static constexpr size_t batchSize = 1024;
+
+    // set by startLexerThread(), the lexer thread owns all lexing state from then on
+    std::unique_ptr<SPSCQueue<TokenBatch, 16>> pipeline;
+    std::thread lexerThread;
+    std::atomic<bool> stopLexer = false;
+    TokenBatch* lexBatch = nullptr;   // being filled by the lexer thread
+    TokenBatch* readBatch = nullptr;  // being consumed by the parser
+    size_t batchCursor = 0;
+
+    // of the diagnostics of buffer or readBatch, see reportLexerDiagnostics()
+    size_t reportedErrors = 0;
+    size_t nextDiagnostic = 0;  // token at which a diagnostic is reported next
 
    public:
-    explicit TokenStream(std::string_view input) : input(input), position(0) {}
+    explicit TokenStream(std::string_view input, const ScanKernels& kernels = ScanKernels::best())
+        : input(input),
+          position(0),
+          kernels(kernels),
+          locations(std::make_shared<SourceLocationIndex>(input)) {}
+
+    explicit TokenStream(std::shared_ptr<const SourceBuffer> source,
+                         const ScanKernels& kernels = ScanKernels::best())
+        : source(source),
+          input(source->view()),
+          position(0),
+          kernels(kernels),
+          locations(std::make_shared<SourceLocationIndex>(input)) {}
+
+    // Streaming mode: input is consumed window by window as the parser advances
+    explicit TokenStream(std::unique_ptr<ChunkedSource> stream,
+                         const ScanKernels& kernels = ScanKernels::best())
+        : stream(std::move(stream)),
+          position(0),
+          kernels(kernels),
+          locations(std::make_shared<SourceLocationIndex>()) {}
+
+    // Reads source from offset begin on, interning identifiers into interner. Lets a part of a
+    // program be lexed again after an edit, with offsets into the whole text.
+    TokenStream(std::shared_ptr<const SourceBuffer> source,
+                std::shared_ptr<StringInterner> interner, size_t begin,
+                const ScanKernels& kernels = ScanKernels::best())
+        : source(source),
+          input(source->view()),
+          position(begin),
+          kernels(kernels),
+          interner(std::move(interner)),
+          locations(std::make_shared<SourceLocationIndex>(input)) {}
+
+    // Reads the tokens [firstToken, endToken) of a stream tokenized by tokenizeAll(), sharing
+    // its tokens, source and interner. Lets ranges of functions be parsed independently.
+    TokenStream(const TokenStream& whole, size_t firstToken, size_t endToken);
+
+    TokenStream(const TokenStream&) = delete;
+    TokenStream& operator=(const TokenStream&) = delete;
+
+    ~TokenStream();
+
+    const std::shared_ptr<const SourceBuffer>& getSource() const { return source; }
+
+    const std::shared_ptr<StringInterner>& getInterner() const { return interner; }
+
+    const std::shared_ptr<SourceLocationIndex>& getLocations() const { return locations; }
+
+    /**
+     * Lexes the whole input up front. Afterwards tokens are served from a TokenBuffer, which
+     * makes peeking free and allows arbitrary lookahead with peekType(ahead). Diagnostics of the
+     * lexer are still raised when the parser reaches their token, see LexerDiagnostics.
+     * Offsets are stored as 32 bit values, returns false if the input is too large for that
+     * or the stream is in streaming mode.
+     */
+    bool tokenizeAll() {
+        tokenizeUntil(input.size());
+        return isTokenized();
+    }
+
+    /**
+     * Like tokenizeAll(), but stops at the first token starting at or after offset end, which
+     * reads as end of file. Also returns false if that token does not start exactly at end, so
+     * that a token or comment crossing end is noticed.
+     */
+    bool tokenizeUntil(size_t end);
+
+    bool isTokenized() const { return buffer != nullptr; }
+
+    /**
+     * Lexes on a separate thread from now on, which hands tokens to the consumer in batches
+     * through a lock-free ring. Lexing then overlaps with parsing.
+     * Returns false in streaming or buffered mode, or if a token has been peeked already.
+     */
+    bool startLexerThread();
+
+    /**
+     * Splits the remaining tokens into at most parts ranges of about equal size, at top-level
+     * function boundaries found by matching braces. Returns the first token of every range
+     * followed by the end of the last one. Requires tokenizeAll().
+     */
+    std::vector<size_t> splitFunctions(size_t parts) const;
 
     [[maybe_unused]] Token next();
 
     Token peek();
 
-    bool empty();
+    // Type of the next token without materializing it. Lookahead > 0 requires tokenizeAll().
+    TokenType peekType(size_t ahead = 0) {
+        if (buffer) {
+            if (cursor >= nextDiagnostic) {
+                reportLexerDiagnostics(buffer->diagnostics, cursor, bufferEnd);
+            }
+
+            size_t idx = cursor + ahead;
+            return idx < bufferEnd ? buffer->type(idx) : TokenType::EndOfFile;
+        }
 
-    std::string_view getCurrentLine() const {
-        return input.substr(lineStart, std::max(input.size() - 1, position + 1));
+        assert(ahead == 0 && "lookahead requires a pre-tokenized stream");
+
+        if (pipeline) {
+            return currentBatch().tokens[batchCursor].type;
+        }
+
+        return peek().type;
     }
 
-    size_t getCurrentLineNumber() const { return line; }
+    bool empty();
+
+    // Offset of the token last returned by next()
+    size_t getOffset() const { return lastOffset; }
 
-    size_t getLinePosition() const { return position - lineStart - 1; }
+    // Offset the lexer is currently at in the whole input
+    size_t getLexerOffset() const { return (stream ? stream->offset() : 0) + position; }
 
    private:
+    // streaming mode: move on to the next window once the current one is consumed
+    bool refill();
+
     char moveToNextToken();
 
+    // lexes the token at the current position, regardless of peeked or buffered tokens
+    Token lex();
+
+    // reports an error found while lexing, deferred to the consumer if lexing ahead
+    void lexError(size_t offset, const std::string& message);
+
+    // Ends the tokens at an unknown token if lexing ahead, reported once the consumer gets there.
+    // Otherwise reports it right away and exits.
+    Token lexUnknownToken();
+
+    void runLexerThread();
+
+    // pipelined mode: batch containing the next token, waits for the lexer thread if needed
+    const TokenBatch& currentBatch();
+
+    /**
+     * Reports the diagnostics of tokens lexed ahead up to the token at index cursor and sets
+     * nextDiagnostic to the token of the next one. Errors of tokens from end on belong to the
+     * next range of a split stream. An unknown token only exits if the stream is not a range,
+     * whose worker parses again sequentially instead.
+     */
+    void reportLexerDiagnostics(const LexerDiagnostics& diagnostics, size_t cursor, size_t end);
+
     Token lexOperator();
     Token lexWord();
     Token lexNumber();
@@ -1,53 +1,101 @@
 #include <getopt.h>
+#include <unistd.h>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Verifier.h>
 #include <llvm/Support/raw_os_ostream.h>
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <ostream>
+#include <span>
+#include <sstream>
 #include <string>
+#include <vector>
 #include "ast.hpp"
+#include "ast_cache.hpp"
 #include "codegen.hpp"
 #include "debug.hpp"
 #include "diagnostics.hpp"
+#include "flat_ast.hpp"
 #include "isel.hpp"
 #include "lexer.hpp"
 #include "parser.hpp"
+#include "printer.hpp"
+#include "source.hpp"
 
 enum class Mode { AST, CHECK, IR, MIR, NONE };
 
 void printUsage() {
-    std::cerr << "usage: ./clonk (-a|-c|-l|-b) source_file\n"
+    std::cerr << "usage: ./clonk (-a|-c|-l|-b|-p|-j threads|-C|-f|-d|-r roots|-n) source_file\n"
               << "    Exits with non-zero status code on invalid input.\n"
+              << "    source_file \"-\" reads the program from stdin as a stream.\n"
               << "    -a: print AST as S-Expressions.\n"
               << "    -c: syntax/semantic check only (build AST nonetheless). No output other than "
                  "the exit code.\n"
               << "    -l: generate LLVM IR and print it.\n"
               << "    -o: output file path.\n"
-              << "    -b: benchmark\n";
+              << "    -b: benchmark\n"
+              << "    -p: lex on a separate thread, overlapping with parsing. With -b also reports "
+                 "the speedup over sequential parsing. Not with -j or source_file \"-\".\n"
+              << "    -j: parse functions on the given number of threads. With -b also reports the "
+                 "speedup over sequential parsing.\n"
+              << "    -C: cache the AST in source_file.astcache and reuse it while the source is "
+                 "unchanged.\n"
+              << "    -f: with -l, generate and print the IR of each function as soon as it is "
+                 "parsed and free it, keeping memory bounded by the largest function. Identical "
+                 "functions are not folded and no cache is written.\n"
+              << "    -d: generate code only for main and the functions it calls, directly or "
+                 "not. Not with -f.\n"
+              << "    -r: like -d, for the comma separated functions given instead of main.\n"
+              << "    -n: generate code for the AST as parsed, without inlining calls of small "
+                 "functions and folding constants first.\n";
 }
 
-Mode parseOption(int argc, char* argv[], bool& benchmark, std::filesystem::path& path, std::filesystem::path& outputPath) {
+Mode parseOption(int argc, char* argv[], bool& benchmark, bool& pipelined, unsigned& threads, bool& useCache, bool& streamCode, std::vector<std::string>& roots, bool& optimize, std::filesystem::path& path, std::filesystem::path& outputPath) {
     int opt;
     benchmark = false;
+    pipelined = false;
+    useCache = false;
+    streamCode = false;
+    optimize = true;
+    threads = 1;
     Mode mode = Mode::NONE;
 
-    while ((opt = getopt(argc, argv, "aclbso:")) != -1) {
+    while ((opt = getopt(argc, argv, "aclbspo:j:Cfdr:n")) != -1) {
         switch (opt) {
             case 'a': mode = Mode::AST; break;
             case 'c': mode = Mode::CHECK; break;
             case 'l': mode = Mode::IR; break;
             case 's': mode = Mode::MIR; break;
             case 'b': benchmark = true; break;
+            case 'p': pipelined = true; break;
             case 'o': outputPath = std::filesystem::path(optarg); break;
+            case 'j': threads = std::max(std::atoi(optarg), 1); break;
+            case 'C': useCache = true; break;
+            case 'f': streamCode = true; break;
+            case 'd': roots = {"main"}; break;
+            case 'r': {
+                roots.clear();
+                std::stringstream list(optarg);
+                for (std::string root; std::getline(list, root, ',');) {
+                    roots.push_back(root);
+                }
+                break;
+            }
+            case 'n': optimize = false; break;
             case '?':
                 if (optopt == 'o')
                     std::cerr << "Option -o requires an argument!" << std::endl;
+                if (optopt == 'j')
+                    std::cerr << "Option -j requires an argument!" << std::endl;
+                if (optopt == 'r')
+                    std::cerr << "Option -r requires an argument!" << std::endl;
             
             default: return Mode::NONE;
         }
@@ -61,24 +109,29 @@ Mode parseOption(int argc, char* argv[], bool& benchmark, std::filesystem::path&
     return mode;
 }
 
-std::string readProgram(std::filesystem::path& path) {
-    std::ifstream file(path);
-    if (!file) {
+std::shared_ptr<const clonk::SourceBuffer> readProgram(std::filesystem::path& path) {
+    auto source = clonk::SourceBuffer::open(path);
+    if (!source) {
         logger::warn("File not found: " + path.string());
         exit(EXIT_FAILURE);
     }
 
-    std::stringstream ss;
-    ss << file.rdbuf();
-    return ss.str();
+    return source;
 }
 
 int main(int argc, char* argv[]) {
     bool benchmark = false;
+    bool pipelined = false;
+    unsigned threads = 1;
+    bool useCache = false;
+    bool streamCode = false;
+    std::vector<std::string> roots;
+    bool optimize = true;
     std::filesystem::path path;
     std::filesystem::path outputPath;
 
-    Mode mode = parseOption(argc, argv, benchmark, path, outputPath);
+    Mode mode = parseOption(argc, argv, benchmark, pipelined, threads, useCache, streamCode, roots,
+                            optimize, path, outputPath);
 
     std::ostream* outputStream = &std::cout;
     std::ofstream file;
@@ -94,6 +147,9 @@ int main(int argc, char* argv[]) {
     }
 
     clonk::AbstractSyntaxTree ast;
+    std::optional<clonk::FlatAST> flatAst;
+    bool streamed = false;
+    bool cached = false;
     std::chrono::steady_clock::time_point start, end;
 
     if (mode == Mode::NONE) {
@@ -101,32 +157,187 @@ int main(int argc, char* argv[]) {
         return EXIT_FAILURE;
 
     } else {
+        if (mode == Mode::IR && streamCode && !roots.empty()) {
+            logger::warn("-d and -r are ignored with -f, code is generated for every function\n");
+        }
+
+        if (pipelined && (threads > 1 || path == "-")) {
+            logger::warn("-p is ignored with -j and for stdin, lexing is not done on a thread\n");
+        }
+
         if (benchmark) {
             start = std::chrono::steady_clock::now();
         }
 
-        std::string program = readProgram(path);
-        clonk::TokenStream ts(program);
-        clonk::Parser parser(ts);
-        ast = parser.parseProgram();
+        std::shared_ptr<const clonk::SourceBuffer> source;
+
+        if (path != "-") {
+            source = readProgram(path);
+
+            if (useCache) {
+                flatAst = clonk::ASTCache::load(clonk::ASTCache::pathFor(path), source->view());
+                cached = flatAst.has_value();
+            }
+        }
+
+        // a cached tree is up to date with the source, nothing to lex or parse
+        if (!cached) {
+            std::unique_ptr<clonk::TokenStream> ts;
+
+            if (path == "-") {
+                ts = std::make_unique<clonk::TokenStream>(
+                    std::make_unique<clonk::ChunkedSource>(STDIN_FILENO));
+            } else {
+                ts = std::make_unique<clonk::TokenStream>(source);
+
+                // Both return false for inputs over 4 GiB, whose offsets do not fit in 32 bits,
+                // and the stream then lexes lazily as the parser advances. Parallel parsing needs
+                // all tokens up front, parseProgramParallel() checks isTokenized() again and
+                // parses sequentially without them.
+                if (pipelined && threads == 1) {
+                    ts->startLexerThread();
+                } else {
+                    ts->tokenizeAll();
+                }
+            }
+
+            clonk::Parser parser(*ts);
+
+            if (path == "-" && (mode == Mode::AST || mode == Mode::CHECK)) {
+                // no need for the whole AST, only keep the function currently being parsed
+                clonk::ASTPrinter printer(*outputStream);
+
+                while (auto function = parser.parseNextFunction()) {
+                    // a fatal error exits without unwinding, what was parsed before is shown
+                    if (mode == Mode::AST) {
+                        printer.print(*function);
+                        printer.flush();
+                    }
+
+                    parser.releaseNodes();
+                }
+
+                streamed = true;
+
+            } else if (mode == Mode::IR && streamCode) {
+                clonk::FunctionStreamer streamer(path.filename(), *outputStream, ts->getSource(),
+                                                 ts->getInterner(), optimize);
+
+                while (auto function = parser.parseNextFunction()) {
+                    streamer.add(*function);
+                    parser.releaseNodes();
+                }
+
+                streamer.finish();
+                streamed = true;
+
+            } else if (threads > 1 && path != "-") {
+                ast = parser.parseProgramParallel(threads);
+
+            } else if (mode == Mode::IR || mode == Mode::MIR) {
+                // code generation only reads the flat AST, the nodes of a function are freed as
+                // soon as it is flattened
+                flatAst.emplace(ts->getSource(), ts->getInterner());
+
+                while (auto function = parser.parseNextFunction()) {
+                    flatAst->addFunction(*function);
+                    parser.releaseNodes();
+                }
+
+                for (auto& [name, paramCount] : parser.getExternFunctions()) {
+                    flatAst->addExternFunction(name, paramCount);
+                }
+
+            } else {
+                ast = parser.parseProgram();
+            }
+
+            if (useCache && source && !streamed && !clonk::DiagnosticsManager::get().isError()) {
+                if (!flatAst) {
+                    flatAst.emplace(ast);
+                }
+
+                std::filesystem::path cachePath = clonk::ASTCache::pathFor(path);
+                if (!clonk::ASTCache::store(cachePath, source->view(), *flatAst)) {
+                    logger::warn("Could not write AST cache: " + cachePath.string() + "\n");
+                }
+            }
+        }
     }
 
     if (benchmark) {
         end = std::chrono::steady_clock::now();
         std::chrono::duration<double> parse_duration = end - start;
         std::cout << "Parsing time: " << parse_duration.count() << " seconds\n";
+        std::optional<std::chrono::duration<double>> sequential_duration;
+
+        if ((pipelined || threads > 1 || cached) && path != "-" &&
+            !clonk::DiagnosticsManager::get().isError()) {
+            // baseline for the speedup: lex everything up front, then parse, without the cache
+            start = std::chrono::steady_clock::now();
+            {
+                clonk::TokenStream sequential(readProgram(path));
+                sequential.tokenizeAll();
+                clonk::AbstractSyntaxTree sequentialAst = clonk::Parser(sequential).parseProgram();
+                sequential_duration = std::chrono::steady_clock::now() - start;
+            }
+        }
+
+        if (sequential_duration) {
+            std::cout << "Sequential parsing time: " << sequential_duration->count()
+                      << " seconds (speedup " << *sequential_duration / parse_duration << "x)\n";
+        }
+
         start = std::chrono::steady_clock::now();
     }
 
     std::unique_ptr<llvm::Module> mod;
     
     switch (mode) {
-        case Mode::AST: *outputStream << ast.to_string() << std::endl; break;
+        case Mode::AST: {
+            if (!streamed) {
+                clonk::ASTPrinter printer(*outputStream);
+
+                if (cached)
+                    printer.print(*flatAst);
+                else
+                    printer.print(ast);
+            }
+
+            *outputStream << std::endl;
+            break;
+        }
         case Mode::CHECK: break;
         case Mode::MIR:
         case Mode::IR: {
+            if (streamed) {
+                break;
+            }
+
+            if (!flatAst) {
+                flatAst.emplace(ast);
+                ast = clonk::AbstractSyntaxTree();
+            }
+
+            // after the cache is written, which holds the tree as it was parsed
+            if (optimize) {
+                flatAst->inlineCalls();
+                flatAst->simplify();
+            }
+
+            for (const std::string& root : roots) {
+                std::span<const clonk::FlatFunction> functions = flatAst->getFunctions();
+                bool defined = std::any_of(functions.begin(), functions.end(), [&](auto& function) {
+                    return flatAst->name(function.name) == root;
+                });
+
+                if (!defined) {
+                    logger::warn("Function given with -d or -r is not defined: %s\n", root.c_str());
+                }
+            }
+
             llvm::LLVMContext ctx;
-            mod = clonk::createModule(ctx, path.filename(), ast);
+            mod = clonk::createModule(ctx, path.filename(), *flatAst, roots);
 
             if (benchmark) {
                 end = std::chrono::steady_clock::now();
@@ -1,11 +1,18 @@
 
 #include "parser.hpp"
+#include <llvm/Support/Casting.h>
+#include <algorithm>
+#include <cassert>
 #include <cstddef>
+#include <cstdint>
 #include <cstdlib>
 #include <memory>
+#include <optional>
+#include <span>
 #include <string>
-#include <unordered_map>
+#include <thread>
 #include <utility>
+#include <vector>
 #include "ast.hpp"
 #include "debug.hpp"
 #include "diagnostics.hpp"
@@ -21,15 +28,30 @@ void Parser::matchToken(TokenType type, const std::string& expected) {
     }
 }
 
-std::unique_ptr<Identifier> Parser::parseIdentifier() {
+namespace {
+
+// Thrown on fatal errors in worker parsers, ends parsing of their range
+struct WorkerAborted {};
+
+}  // namespace
+
+void Parser::fatalError() {
+    if (isWorker) {
+        throw WorkerAborted();
+    }
+
+    exit(EXIT_FAILURE);
+}
+
+Identifier* Parser::parseIdentifier() {
     Token token = ts.next();
 
     if (token.type != TokenType::IdentifierType) {
         DiagnosticsManager::get().unexpectedToken(ts, token);
-        exit(EXIT_FAILURE);
+        fatalError();
     }
 
-    return std::make_unique<Identifier>(std::string(token.getIdentifier()));
+    return arena->create<Identifier>(token.getSymbol());
 }
 
 static int getBinOpPrecedence(TokenType op) {
@@ -57,354 +79,747 @@ static int getBinOpPrecedence(TokenType op) {
     }
 }
 
-std::vector<std::unique_ptr<Expression>> Parser::parseFunctionCallParamList() {
-    matchToken(TokenType::ParenthesisL);
-    std::vector<std::unique_ptr<Expression>> params;
-    if (ts.peek().type != TokenType::ParenthesisR) {
-        params.push_back(parseExpression());
-    }
+namespace {
+
+// Operator or bracket the expression parser has seen but not applied yet. Brackets (parentheses,
+// calls and indexing) separate the operators of nested expressions on the stack.
+struct PendingOp {
+    enum Kind : uint8_t { Binary, Unary, AddressOf, Paren, Call, Index };
+
+    Kind kind;
+    TokenType op = TokenType::EndOfFile;  // Binary and Unary
+    int precedence = 0;                   // Binary
+    size_t firstArgument = 0;             // Call: position of the first argument on the operands
+    Identifier* function = nullptr;       // Call
+};
+
+}  // namespace
+
+// Operator precedence parsing with explicit operator and operand stacks instead of recursion, so
+// nesting of parentheses, unary operators, calls and indexing is bounded by heap memory only.
+// Binary operators are reduced by the rules of precedence climbing: a new left associative
+// operator reduces pending operators of equal precedence, assignment does not, which makes it
+// right associative.
+Expression* Parser::parseExpression() {
+    std::vector<PendingOp> ops;
+    std::vector<Expression*> operands;
+
+    bool expectOperand = true;
+    bool isValue = false;  // the last operand is an identifier, call or indexing
+
+    // applies the pending unary operators and the binary operators binding at least as tight as
+    // precedence, up to the innermost open bracket
+    auto reduce = [&](int precedence) {
+        while (!ops.empty()) {
+            const PendingOp& top = ops.back();
+
+            if (top.kind == PendingOp::Binary && top.precedence >= precedence) {
+                Expression* right = operands.back();
+                operands.pop_back();
+                operands.back() = arena->create<BinOp>(operands.back(), right, top.op);
+
+            } else if (top.kind == PendingOp::Unary) {
+                operands.back() = arena->create<UnOp>(operands.back(), top.op);
+
+            } else if (top.kind == PendingOp::AddressOf) {
+                checkAddressOf(operands.back());
+                operands.back() = arena->create<UnOp>(operands.back(), TokenType::OpAmp);
+
+            } else {
+                break;
+            }
 
-    while (ts.peek().type == TokenType::Comma) {
-        ts.next();
-        params.push_back(parseExpression());
-    }
+            ops.pop_back();
+        }
+    };
 
-    matchToken(TokenType::ParenthesisR, "closing parenthesis of function call");
+    auto finishCall = [&](const PendingOp& call) {
+        matchToken(TokenType::ParenthesisR, "closing parenthesis of function call");
 
-    return params;
-}
+        std::span<Expression* const> params(operands.begin() + call.firstArgument, operands.end());
+        checkFunctionParamCounts(*call.function, params.size());
 
-std::unique_ptr<Expression> Parser::parseTerm() {
-    TokenType next = ts.peek().type;
-    std::unique_ptr<Expression> expr;
+        auto funcCall = arena->create<FunctionCall>(call.function, arena->copy(params));
+        operands.resize(call.firstArgument);
+        operands.push_back(funcCall);
 
-    switch (next) {
-        case TokenType::ParenthesisL: {
-            ts.next();
-            expr = parseExpression();
-            matchToken(TokenType::ParenthesisR, "closing parenthesis around expression");
-            return expr;
+        // a call can only be referenced through indexing
+        if (!ops.empty() && ops.back().kind == PendingOp::AddressOf &&
+            ts.peekType() != TokenType::BracketL) {
+            DiagnosticsManager::get().error(ts, "expected lvalue");
+            fatalError();
         }
-        case TokenType::OpAmp: {
-            ts.next();
-            Token token = ts.peek();
-            expr = parseValue(true);
-
-            if (!dynamic_cast<IndexExpr*>(expr.get())) {
-                auto scopedIdent = scopes.get(token.getIdentifier());
-
-                if (scopedIdent->isRegister) {
-                    DiagnosticsManager::get().error(ts, "cannot reference register type \"" +
-                                                            std::string(token.getIdentifier()) +
-                                                            "\"");
-                } else if (scopedIdent->isFunctionParam) {
-                    DiagnosticsManager::get().error(ts, "cannot reference function parameter \"" +
-                                                            std::string(token.getIdentifier()) +
-                                                            "\"");
+    };
+
+    while (true) {
+        TokenType next = ts.peekType();
+
+        if (expectOperand) {
+            switch (next) {
+                case TokenType::ParenthesisL: {
+                    ts.next();
+                    ops.push_back({PendingOp::Paren});
+                    continue;
+                }
+                case TokenType::OpNot:
+                case TokenType::OpMinus:
+                case TokenType::OpBitNot: {
+                    ts.next();
+                    ops.push_back({PendingOp::Unary, next});
+                    continue;
+                }
+                case TokenType::NumberLiteral: {
+                    Token num = ts.next();
+                    operands.push_back(arena->create<IntLiteral>(num.getValue()));
+                    isValue = false;
+                    break;
+                }
+                case TokenType::OpAmp: {
+                    // only a value can be referenced, the identifier is required
+                    ts.next();
+                    ops.push_back({PendingOp::AddressOf});
+                    [[fallthrough]];
+                }
+                case TokenType::IdentifierType: {
+                    Identifier* ident = parseIdentifier();
+
+                    if (ts.peekType() == TokenType::ParenthesisL) {
+                        ts.next();
+                        PendingOp call = {PendingOp::Call, TokenType::EndOfFile, 0,
+                                          operands.size(), ident};
+
+                        if (ts.peekType() != TokenType::ParenthesisR) {
+                            ops.push_back(call);
+                            continue;
+                        }
+
+                        finishCall(call);
+
+                    } else {
+                        // the same variable as its declaration
+                        if (auto declaration = scopes.get(ident->symbol)) {
+                            ident->slot = declaration->value->slot;
+                        } else {
+                            DiagnosticsManager::get().error(
+                                ts, "unknown identifier: \"" + std::string(ident->name) + "\"");
+                            ident->slot = slotCount++;  // still in bounds of the slot arrays
+                        }
+
+                        operands.push_back(ident);
+                    }
+
+                    isValue = true;
+                    break;
+                }
+                default: {
+                    ts.next();
+                    DiagnosticsManager::get().unexpectedToken(ts, ts.peek());
+                    fatalError();
                 }
             }
 
-            return std::make_unique<UnOp>(std::move(expr), TokenType::OpAmp);
-        }
-        case TokenType::OpNot:
-        case TokenType::OpMinus:
-        case TokenType::OpBitNot: {
-            TokenType op = ts.next().type;
-            expr = parseTerm();
-            return std::make_unique<UnOp>(std::move(expr), op);
+            expectOperand = false;
+            continue;
         }
 
-        case TokenType::NumberLiteral: {
-            Token num = ts.next();
-            return std::make_unique<IntLiteral>(num.getValue());
-        }
-        case TokenType::IdentifierType: {
-            return parseValue();
-        }
-        default: {
+        // allow an arbitrary number of indexing expressions on values
+        if (isValue && next == TokenType::BracketL) {
             ts.next();
-            DiagnosticsManager::get().unexpectedToken(ts, ts.peek());
-            exit(EXIT_FAILURE);
+            ops.push_back({PendingOp::Index});
+            expectOperand = true;
+            continue;
         }
-    }
-}
 
-std::unique_ptr<Expression> Parser::parseExpression() {
-    std::unique_ptr<Expression> expr = parseTerm();
+        int precedence = getBinOpPrecedence(next);
 
-    while (true) {
-        Token op = ts.peek();
+        if (precedence > 0) {
+            Token opToken = ts.next();
+            reduce(next == TokenType::OpAssign ? precedence + 1 : precedence);
 
-        int precedence = getBinOpPrecedence(op.type);
-
-        if (precedence == -1) {
-            if (op.type == TokenType::OpAssign && !dynamic_cast<LValue*>(expr.get())) {
-                DiagnosticsManager::get().unexpectedToken(ts, op,
+            if (next == TokenType::OpAssign && !llvm::isa<LValue>(operands.back())) {
+                DiagnosticsManager::get().unexpectedToken(ts, opToken,
                                                           "cannot assign to rvalue expression");
             }
 
-            return expr;
-        }
-
-        // expr is a BinOp
-        if (precedence < 0) {
-            logger::debug("Expected BinOp token: %d %d \n", op.type);
-            DiagnosticsManager::get().unexpectedToken(ts, op);
-            exit(EXIT_FAILURE);
+            ops.push_back({PendingOp::Binary, next, precedence});
+            expectOperand = true;
+            continue;
         }
 
-        ts.next();
-
-        std::unique_ptr<Expression> right = parseTerm();
-
-        BinOp* leftBinop;
+        // the innermost open expression ends here
+        reduce(0);
 
-        std::unique_ptr<Expression> result;
+        if (ops.empty()) {
+            return operands.back();
+        }
 
-        if ((leftBinop = dynamic_cast<BinOp*>(expr.get()))) {
-            int leftPrecedence = getBinOpPrecedence(leftBinop->op);
+        PendingOp open = ops.back();
+        ops.pop_back();
 
-            if (precedence > leftPrecedence ||
-                (precedence == leftPrecedence && op.type == TokenType::OpAssign)) {
-                if (op.type == TokenType::OpAssign &&
-                    !dynamic_cast<LValue*>(leftBinop->leftExpr.get())) {
-                    DiagnosticsManager::get().unexpectedToken(ts, op,
-                                                              "cannot assign to rvalue expression");
+        switch (open.kind) {
+            case PendingOp::Paren: {
+                matchToken(TokenType::ParenthesisR, "closing parenthesis around expression");
+                isValue = false;
+                break;
+            }
+            case PendingOp::Call: {
+                if (next == TokenType::Comma) {
+                    ts.next();
+                    ops.push_back(open);
+                    expectOperand = true;
+                    break;
                 }
 
-                expr =
-                    std::make_unique<BinOp>(std::move(leftBinop->leftExpr),
-                                            std::make_unique<BinOp>(std::move(leftBinop->rightExpr),
-                                                                    std::move(right), op.type),
-                                            leftBinop->op);
-                continue;
-
-            } else if (op.type == TokenType::OpAssign) {
-                DiagnosticsManager::get().unexpectedToken(ts, op,
-                                                          "cannot assign to rvalue expression");
+                finishCall(open);
+                isValue = true;
+                break;
             }
+            case PendingOp::Index: {
+                Expression* idxExpr = operands.back();
+                operands.pop_back();
+                int sizeSpec = 8;
+
+                if (next == TokenType::SizeSpec) {
+                    ts.next();
+                    Token sizeToken = ts.next();
+
+                    if (sizeToken.type != TokenType::NumberLiteral) {
+                        // workers stay quiet, the sequential parse after them logs this
+                        if (!isWorker)
+                            logger::warn("Invalid sizespec: \n", sizeToken.type);
+
+                        DiagnosticsManager::get().unexpectedToken(ts, sizeToken);
+                        fatalError();
+
+                    } else if (sizeToken.getValue() != 1 && sizeToken.getValue() != 2 &&
+                               sizeToken.getValue() != 4 && sizeToken.getValue() != 8) {
+                        DiagnosticsManager::get().unexpectedToken(
+                            ts, sizeToken,
+                            "Invalid sizespec, must be 1, 2, 4 or 8, was " +
+                                std::to_string(sizeToken.getValue()));
+                        fatalError();
+                    }
+
+                    sizeSpec = sizeToken.getValue();
+                }
 
-        } else {
-            if (op.type == TokenType::OpAssign && !dynamic_cast<LValue*>(expr.get())) {
-                DiagnosticsManager::get().unexpectedToken(ts, op,
-                                                          "cannot assign to rvalue expression");
+                matchToken(TokenType::BracketR, "closing bracket of indexing operation");
+                operands.back() = arena->create<IndexExpr>(operands.back(), idxExpr, sizeSpec);
+                isValue = true;
+                break;
             }
+            default: assert(false && "operators are reduced before brackets");
         }
-
-        expr = std::make_unique<BinOp>(std::move(expr), std::move(right), op.type);
     }
-
-    return expr;
 }
 
-std::unique_ptr<Block> Parser::parseBlock() {
-    matchToken(TokenType::BraceL, "opening brace in block");
-    scopes.enterScope();
-
-    std::vector<std::unique_ptr<Statement>> statements;
-
-    while (ts.peek().type != TokenType::BraceR) {
-        statements.push_back(parseDeclStatement());
+// Registers and parameters live in SSA values, they have no address
+void Parser::checkAddressOf(const Expression* operand) {
+    if (llvm::isa<IndexExpr>(operand)) {
+        return;
     }
 
-    matchToken(TokenType::BraceR, "closing brace in block");
+    auto ident = llvm::cast<Identifier>(operand);
+    auto scopedIdent = scopes.get(ident->symbol);
 
-    scopes.leaveScope();
-    return std::make_unique<Block>(std::move(statements));
+    if (!scopedIdent) {
+        // already reported as unknown identifier
+    } else if (scopedIdent->isRegister) {
+        DiagnosticsManager::get().error(
+            ts, "cannot reference register type \"" + std::string(ident->name) + "\"");
+    } else if (scopedIdent->isFunctionParam) {
+        DiagnosticsManager::get().error(
+            ts, "cannot reference function parameter \"" + std::string(ident->name) + "\"");
+    }
 }
 
-std::vector<std::unique_ptr<Identifier>> Parser::parseParamlist() {
-    std::vector<std::unique_ptr<Identifier>> params;
+std::vector<Identifier*> Parser::parseParamlist() {
+    std::vector<Identifier*> params;
 
-    if (ts.peek().type == TokenType::IdentifierType) {
-        std::unique_ptr<Identifier> ident = parseIdentifier();
-        scopes.insert(ident->name, ident->name, false, true);
-        params.push_back(std::move(ident));
+    if (ts.peekType() == TokenType::IdentifierType) {
+        Identifier* ident = parseIdentifier();
+        ident->slot = slotCount++;
+        scopes.insert(ident->symbol, ident, false, true);
+        params.push_back(ident);
     }
 
-    while (ts.peek().type == TokenType::Comma) {
+    while (ts.peekType() == TokenType::Comma) {
         matchToken(TokenType::Comma, "parameter seperator comma");
-        std::unique_ptr<Identifier> ident = parseIdentifier();
-        std::string newName = scopes.insert(ident->name, ident->name, false, true);
+        Identifier* ident = parseIdentifier();
+        ident->slot = slotCount++;
 
-        if (newName.empty()) {
+        if (!scopes.insert(ident->symbol, ident, false, true)) {
             DiagnosticsManager::get().error(
-                ts, "duplicate function parameter: \"" + ident->name + "\"");
+                ts, "duplicate function parameter: \"" + std::string(ident->name) + "\"");
         }
 
-        ident->name = newName;
-        params.push_back(std::move(ident));
+        params.push_back(ident);
     }
 
     return params;
 }
 
-std::unique_ptr<Function> Parser::parseFunction() {
-    std::unique_ptr<Identifier> ident = parseIdentifier();
-    declaredFunctions.insert(ident->name);
+Function* Parser::parseFunction() {
+    size_t begin = ts.peek().offset;
+    size_t bytesBefore = arena->bytesUsed();
+    Identifier* ident = parseIdentifier();
+
+    if (ident->symbol >= declaredFunctions.size()) {
+        declaredFunctions.resize(ident->symbol + 1);
+    }
+    declaredFunctions[ident->symbol] = true;
 
     matchToken(TokenType::ParenthesisL, "parameter list opening parenthesis");
-    std::vector<std::unique_ptr<Identifier>> params = parseParamlist();
+    std::vector<Identifier*> params = parseParamlist();
     matchToken(TokenType::ParenthesisR, "parameter list closing parenthesis");
-    std::unique_ptr<Block> block = parseBlock();
+    Block* block = parseBlock();
 
-    checkFunctionParamCounts(ident->name, params.size());
-    auto retval = std::make_unique<Function>(std::move(ident), std::move(params), std::move(block), autoDecls);
+    checkFunctionParamCounts(*ident, params.size());
+    auto function =
+        arena->create<Function>(ident, arena->copy(params), block, arena->copy(autoDecls),
+                                slotCount, arena->copy(paramCountUses));
     autoDecls.clear();
-    return retval;
+    paramCountUses.clear();
+    slotCount = 0;
+
+    lastFunction = {begin, ts.getOffset() + 1, arena->bytesUsed() - bytesBefore};
+    return function;
 }
 
-void Parser::checkFunctionParamCounts(const std::string& name, size_t paramCount) {
-    if (paramCounts.find(name) == paramCounts.end()) {
-        paramCounts[name] = paramCount;
+void Parser::checkFunctionParamCounts(const Identifier& ident, size_t paramCount) {
+    paramCountUses.push_back({ident.symbol, static_cast<uint32_t>(paramCount)});
+
+    if (ident.symbol >= paramCounts.size()) {
+        paramCounts.resize(ident.symbol + 1);
+    }
+
+    std::optional<size_t>& count = paramCounts[ident.symbol];
+
+    if (!count) {
+        count = paramCount;
 
-    } else if (paramCounts[name] != paramCount) {
+    } else if (*count != paramCount) {
         DiagnosticsManager::get().error(
-            ts, "function \"" + name + "\" called with missmatching number of parameters: " +
+            ts, "function \"" + std::string(ident.name) +
+                    "\" called with missmatching number of parameters: " +
                     std::to_string(paramCount) + " previously called with " +
-                    std::to_string(paramCounts[name]) + " parameters");
+                    std::to_string(*count) + " parameters");
     }
 }
 
-std::unique_ptr<Expression> Parser::parseValue(bool lvalue) {
-    std::unique_ptr<Identifier> ident = parseIdentifier();
-    std::unique_ptr<Expression> value;
+Statement* Parser::parseDeclaration() {
+    TokenType type = ts.next().type;
+    Identifier* ident = parseIdentifier();
 
-    TokenType type = ts.peek().type;
+    matchToken(TokenType::OpAssign, "assignment operator in declaration");
+    Expression* expr = parseExpression();
+    matchToken(TokenType::EndOfStatement, "\";\"");
 
-    if (type == TokenType::ParenthesisL) {
-        auto params = parseFunctionCallParamList();
-        checkFunctionParamCounts(ident->name, params.size());
+    ident->slot = slotCount++;
 
-        value = std::make_unique<FunctionCall>(std::move(ident), std::move(params));
+    if (!scopes.insert(ident->symbol, ident, type == TokenType::KeyRegister, false)) {
+        DiagnosticsManager::get().error(
+            ts, "redeclared identifier \"" + std::string(ident->name) + "\"");
+    }
 
-        if (lvalue && ts.peek().type != TokenType::BracketL) {
-            DiagnosticsManager::get().error(ts, "expected lvalue");
-            exit(EXIT_FAILURE);
-        }
+    if (type == TokenType::KeyAuto)
+        autoDecls.push_back(ident);
 
-    } else {
-        if (!scopes.get(ident->name)) {
-            DiagnosticsManager::get().error(ts, "unknown identifier: \"" + ident->name + "\"");
-        }
+    return arena->create<Declaration>(type == TokenType::KeyAuto, type == TokenType::KeyRegister,
+                                      ident, expr);
+}
 
-        value = std::move(ident);
-    }
+namespace {
+
+// Statement whose body or remaining statements are still being parsed
+struct OpenStatement {
+    enum Kind : uint8_t { Block, IfBody, ElseBody, WhileBody };
+
+    Kind kind;
+    size_t firstStatement = 0;  // Block: position of its first statement on the statement stack
+    Expression* condition = nullptr;
+    Statement* thenStatement = nullptr;  // ElseBody
+};
+
+}  // namespace
+
+// Parses a block including all nested statements. Statements that are still open are kept on an
+// explicit stack instead of recursing, so nesting depth is bounded by heap memory only.
+Block* Parser::parseBlock() {
+    std::vector<OpenStatement> open;
+    std::vector<Statement*> blockStatements;  // finished statements of all open blocks
+
+    auto openBlock = [&] {
+        matchToken(TokenType::BraceL, "opening brace in block");
+        scopes.enterScope();
+        open.push_back({OpenStatement::Block, blockStatements.size()});
+    };
+
+    openBlock();
+
+    while (true) {
+        TokenType next = ts.peekType();
+        bool inBlock = open.back().kind == OpenStatement::Block;
+        Statement* statement;
+
+        if (inBlock && next == TokenType::BraceR) {
+            matchToken(TokenType::BraceR, "closing brace in block");
+            scopes.leaveScope();
 
-    // allow an arbitrary number of indexing expressions
+            size_t first = open.back().firstStatement;
+            std::span<Statement* const> statements(blockStatements.begin() + first,
+                                                   blockStatements.end());
+            statement = arena->create<Block>(arena->copy(statements));
 
-    while (ts.peek().type == TokenType::BracketL) {
-        ts.next();
+            blockStatements.resize(first);
+            open.pop_back();
 
-        std::unique_ptr<Expression> idxExpr = parseExpression();
+        } else if (inBlock && (next == TokenType::KeyAuto || next == TokenType::KeyRegister)) {
+            statement = parseDeclaration();
 
-        if (ts.peek().type == TokenType::SizeSpec) {
+        } else if (next == TokenType::KeyReturn) {
             ts.next();
-            Token sizeSpec = ts.next();
-
-            if (sizeSpec.type != TokenType::NumberLiteral) {
-                logger::warn("Invalid sizespec: \n", sizeSpec.type);
-                DiagnosticsManager::get().unexpectedToken(ts, sizeSpec);
-                exit(EXIT_FAILURE);
-
-            } else if (sizeSpec.getValue() != 1 && sizeSpec.getValue() != 2 &&
-                       sizeSpec.getValue() != 4 && sizeSpec.getValue() != 8) {
-                DiagnosticsManager::get().unexpectedToken(
-                    ts, sizeSpec,
-                    "Invalid sizespec, must be 1, 2, 4 or 8, was " +
-                        std::to_string(sizeSpec.getValue()));
-                exit(EXIT_FAILURE);
+
+            if (ts.peekType() == TokenType::EndOfStatement) {
+                ts.next();
+                statement = arena->create<ReturnStatement>();
+            } else {
+                Expression* expr = parseExpression();
+                matchToken(TokenType::EndOfStatement, "\";\"");
+                statement = arena->create<ReturnStatement>(expr);
             }
 
-            matchToken(TokenType::BracketR, "closing bracket of indexing operation");
-            value = std::make_unique<IndexExpr>(std::unique_ptr<Expression>(std::move(value)),
-                                                std::move(idxExpr), sizeSpec.getValue());
+        } else if (next == TokenType::KeyIf) {
+            ts.next();
+            matchToken(TokenType::ParenthesisL, "opening parenthesis around if condition");
+            Expression* expr = parseExpression();
+            matchToken(TokenType::ParenthesisR, "closing parenthesis around if condition");
+            open.push_back({OpenStatement::IfBody, 0, expr});
+            continue;
+
+        } else if (next == TokenType::KeyWhile) {
+            ts.next();
+            matchToken(TokenType::ParenthesisL, "opening parenthesis around while condition");
+            Expression* expr = parseExpression();
+            matchToken(TokenType::ParenthesisR, "closing parenthesis around while condition");
+            open.push_back({OpenStatement::WhileBody, 0, expr});
+            continue;
+
+        } else if (next == TokenType::BraceL) {
+            openBlock();
+            continue;
 
         } else {
-            matchToken(TokenType::BracketR, "closing bracket of indexing operation");
-            value = std::make_unique<IndexExpr>(std::unique_ptr<Expression>(std::move(value)),
-                                                std::move(idxExpr));
+            Expression* expr = parseExpression();
+            matchToken(TokenType::EndOfStatement, "\";\"");
+            statement = arena->create<ExprStatement>(expr);
         }
-    }
 
-    return std::unique_ptr<Expression>(std::move(value));
+        // hand the finished statement to the statements it completes
+        while (true) {
+            if (open.empty()) {
+                return llvm::cast<Block>(statement);
+            }
+
+            OpenStatement& parent = open.back();
+
+            if (parent.kind == OpenStatement::Block) {
+                blockStatements.push_back(statement);
+                break;
+            }
+
+            if (parent.kind == OpenStatement::IfBody && ts.peekType() == TokenType::KeyElse) {
+                ts.next();
+                parent.kind = OpenStatement::ElseBody;
+                parent.thenStatement = statement;
+                break;
+            }
+
+            if (parent.kind == OpenStatement::WhileBody) {
+                statement = arena->create<WhileStatement>(parent.condition, statement);
+            } else if (parent.kind == OpenStatement::IfBody) {
+                statement = arena->create<IfStatement>(parent.condition, statement);
+            } else {
+                statement =
+                    arena->create<IfStatement>(parent.condition, parent.thenStatement, statement);
+            }
+
+            open.pop_back();
+        }
+    }
 }
 
-std::unique_ptr<Statement> Parser::parseDeclStatement() {
-    TokenType type = ts.peek().type;
-    if (type == TokenType::KeyAuto || type == TokenType::KeyRegister) {
-        ts.next();
-        std::unique_ptr<Identifier> ident = parseIdentifier();
+AbstractSyntaxTree Parser::parseProgramParallel(unsigned threads) {
+    if (!ts.isTokenized() || threads < 2) {
+        return parseProgram();
+    }
 
-        matchToken(TokenType::OpAssign, "assignment operator in declaration");
-        std::unique_ptr<Expression> expr = parseExpression();
-        matchToken(TokenType::EndOfStatement, "\";\"");
+    std::vector<size_t> bounds = ts.splitFunctions(threads);
+    size_t ranges = bounds.size() - 1;
 
-        ident->name  =
-            scopes.insert(ident->name, ident->name, type == TokenType::KeyRegister, false);
+    if (ranges < 2) {
+        return parseProgram();
+    }
 
-        if (ident->name.empty()) {
-            DiagnosticsManager::get().error(ts, "redeclared identifier \"" + ident->name + "\"");
+    struct Worker {
+        std::unique_ptr<TokenStream> ts;
+        std::unique_ptr<Parser> parser;
+        DiagnosticsManager diagnostics;
+        std::vector<Function*> functions;
+        std::vector<FunctionSource> functionSources;
+        bool failed = false;
+    };
+
+    std::vector<Worker> workers(ranges);
+
+    for (size_t i = 0; i < ranges; i++) {
+        workers[i].ts = std::make_unique<TokenStream>(ts, bounds[i], bounds[i + 1]);
+        workers[i].parser = std::make_unique<Parser>(*workers[i].ts);
+        workers[i].parser->isWorker = true;
+    }
+
+    auto parseRange = [&workers](size_t i) {
+        Worker& worker = workers[i];
+        DiagnosticsManager::ThreadRedirect redirect(worker.diagnostics);
+
+        try {
+            while (auto function = worker.parser->parseNextFunction()) {
+                worker.functions.push_back(function);
+                worker.functionSources.push_back(worker.parser->lastFunction);
+            }
+        } catch (const WorkerAborted&) {
+            worker.failed = true;
         }
 
-        if (type == TokenType::KeyAuto)
-            autoDecls.push_back(std::string_view(ident->name));
+        worker.failed |= worker.diagnostics.isError();
+    };
+
+    // the calling thread takes the first range
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < ranges; i++) {
+        pool.emplace_back(parseRange, i);
+    }
 
-        return std::make_unique<Declaration>(type == TokenType::KeyAuto,
-                                             type == TokenType::KeyRegister, std::move(ident),
-                                             std::move(expr));
+    parseRange(0);
 
-    } else {
-        return parseStatement();
+    for (std::thread& thread : pool) {
+        thread.join();
     }
+
+    // Merge the call arity tables in program order, the first use of a function determines its
+    // arity like in a sequential parse
+    std::vector<std::optional<size_t>> mergedCounts = paramCounts;
+    std::vector<bool> mergedDeclared = declaredFunctions;
+    bool failed = false;
+
+    for (const Worker& worker : workers) {
+        const Parser& parser = *worker.parser;
+        failed |= worker.failed;
+
+        if (parser.paramCounts.size() > mergedCounts.size()) {
+            mergedCounts.resize(parser.paramCounts.size());
+        }
+
+        for (SymbolId symbol = 0; symbol < parser.paramCounts.size(); symbol++) {
+            const std::optional<size_t>& count = parser.paramCounts[symbol];
+
+            if (!count) {
+                continue;
+            } else if (!mergedCounts[symbol]) {
+                mergedCounts[symbol] = count;
+            } else if (*mergedCounts[symbol] != *count) {
+                failed = true;
+            }
+        }
+
+        if (parser.declaredFunctions.size() > mergedDeclared.size()) {
+            mergedDeclared.resize(parser.declaredFunctions.size());
+        }
+
+        for (SymbolId symbol = 0; symbol < parser.declaredFunctions.size(); symbol++) {
+            if (parser.declaredFunctions[symbol]) {
+                mergedDeclared[symbol] = true;
+            }
+        }
+    }
+
+    if (failed) {
+        // parse again on this thread, to report the errors as a sequential parse would
+        return parseProgram();
+    }
+
+    paramCounts = std::move(mergedCounts);
+    declaredFunctions = std::move(mergedDeclared);
+
+    AbstractSyntaxTree ast;
+    ast.source = ts.getSource();
+    ast.interner = ts.getInterner();
+
+    for (Worker& worker : workers) {
+        for (size_t i = 0; i < worker.functions.size(); i++) {
+            ast.addFunction(worker.functions[i], worker.functionSources[i]);
+        }
+
+        ast.arenas.push_back(std::move(worker.parser->arena));
+    }
+
+    for (auto& [name, paramCount] : getExternFunctions()) {
+        ast.addExternFunction(name, paramCount);
+    }
+
+    return ast;
 }
 
-std::unique_ptr<Statement> Parser::parseStatement() {
-    TokenType next = ts.peek().type;
-    if (next == TokenType::KeyReturn) {
-        ts.next();
-        if (ts.peek().type == TokenType::EndOfStatement) {
-            ts.next();
-            return std::make_unique<ReturnStatement>();
+AbstractSyntaxTree Parser::reparse(AbstractSyntaxTree previous,
+                                   std::shared_ptr<const SourceBuffer> source,
+                                   const TextEdit& edit) {
+    assert(edit.begin <= edit.oldEnd && edit.begin <= edit.newEnd &&
+           edit.newEnd <= source->view().size());
+
+    auto parseFromScratch = [&source] {
+        TokenStream ts(source);
+        ts.tokenizeAll();
+        return Parser(ts).parseProgram();
+    };
+
+    if (!previous.interner) {
+        return parseFromScratch();
+    }
+
+    AbstractSyntaxTree& ast = previous;
+    std::vector<ParamCountTally>& tallies = ast.paramCountTallies;
+
+    // adds or removes the calls and the definition of function, false on a mismatching count
+    auto tally = [&tallies](const Function* function, bool add) {
+        for (auto [symbol, paramCount] : function->paramCountUses) {
+            ParamCountTally& tally = tallies[symbol];
+
+            if (!add) {
+                tally.uses--;
+            } else if (tally.uses++ == 0) {
+                tally.paramCount = paramCount;
+            } else if (tally.paramCount != paramCount) {
+                return false;
+            }
         }
 
-        std::unique_ptr<Expression> expr = parseExpression();
-        matchToken(TokenType::EndOfStatement, "\";\"");
-        return std::make_unique<ReturnStatement>(std::move(expr));
+        ParamCountTally& definition = tallies[function->ident->symbol];
+        add ? definition.definitions++ : definition.definitions--;
+        return true;
+    };
+
+    if (tallies.empty()) {
+        tallies.resize(ast.interner->size());
+
+        for (size_t i = 0; i < ast.functions.size(); i++) {
+            tally(ast.functions[i], true);
+            ast.liveNodeBytes += ast.functionSources[i].nodeBytes;
+        }
     }
 
-    if (next == TokenType::KeyIf) {
-        ts.next();
-        matchToken(TokenType::ParenthesisL, "opening parenthesis around if condition");
-        std::unique_ptr<Expression> expr = parseExpression();
-        matchToken(TokenType::ParenthesisR, "closing parenthesis around if condition");
-        std::unique_ptr<Statement> statement = parseStatement();
+    // Functions [first, last) are parsed again. A function that only borders on the edit is
+    // included, its first or last token may continue into the inserted text.
+    std::vector<FunctionSource>& sources = ast.functionSources;
 
-        if (ts.peek().type == TokenType::KeyElse) {
-            ts.next();
-            std::unique_ptr<Statement> elseStatement = parseStatement();
+    size_t first = std::partition_point(sources.begin(), sources.end(),
+                                        [&](const FunctionSource& function) {
+                                            return function.end < edit.begin;
+                                        }) -
+                   sources.begin();
+
+    size_t last = std::partition_point(sources.begin() + first, sources.end(),
+                                       [&](const FunctionSource& function) {
+                                           return function.begin <= edit.oldEnd;
+                                       }) -
+                  sources.begin();
+
+    // the functions after the edit keep their text, moved by the size difference
+    auto moved = [&](size_t offset) { return offset - edit.oldEnd + edit.newEnd; };
+
+    // from behind the last untouched function before the edit up to the first one after it
+    size_t begin = first > 0 ? sources[first - 1].end : 0;
+    size_t end = last < sources.size() ? moved(sources[last].begin) : source->view().size();
+
+    // nodes of replaced functions stay in their arenas until the tree is parsed from scratch
+    for (size_t i = first; i < last; i++) {
+        ast.liveNodeBytes -= sources[i].nodeBytes;
+    }
+
+    if (ast.memoryUsage() - ast.liveNodeBytes > ast.liveNodeBytes) {
+        return parseFromScratch();
+    }
+
+    TokenStream ts(source, ast.interner, begin);
+    Parser parser(ts);
+    parser.isWorker = true;
+
+    std::vector<Function*> functions;
+    std::vector<FunctionSource> functionSources;
+    DiagnosticsManager diagnostics;
+    bool failed = false;
+
+    {
+        DiagnosticsManager::ThreadRedirect redirect(diagnostics);
+
+        // the last token has to end before the next untouched function, otherwise the edit
+        // changed how the text after it is lexed, e.g. by joining two identifiers
+        failed = !ts.tokenizeUntil(end);
 
-            return std::make_unique<IfStatement>(std::move(expr), std::move(statement),
-                                                 std::move(elseStatement));
+        try {
+            while (!failed && !ts.empty()) {
+                functions.push_back(parser.parseFunction());
+                functionSources.push_back(parser.lastFunction);
+            }
+        } catch (const WorkerAborted&) {
+            failed = true;
         }
 
-        return std::make_unique<IfStatement>(std::move(expr), std::move(statement));
+        failed |= diagnostics.isError();
     }
 
-    if (next == TokenType::KeyWhile) {
-        ts.next();
-        matchToken(TokenType::ParenthesisL, "opening parenthesis around while condition");
-        std::unique_ptr<Expression> expr = parseExpression();
-        matchToken(TokenType::ParenthesisR, "closing parenthesis around while condition");
-        std::unique_ptr<Statement> stmt = parseStatement();
-        return std::make_unique<WhileStatement>(std::move(expr), std::move(stmt));
+    // A mismatching parameter count is an error at a call that may not have been parsed again,
+    // the parse from scratch reports it
+    tallies.resize(ast.interner->size());
+
+    for (size_t i = first; i < last; i++) {
+        tally(ast.functions[i], false);
     }
 
-    if (next == TokenType::BraceL) {
-        return parseBlock();
+    for (size_t i = 0; i < functions.size() && !failed; i++) {
+        failed = !tally(functions[i], true);
     }
 
-    std::unique_ptr<Expression> expr = parseExpression();
-    matchToken(TokenType::EndOfStatement, "\";\"");
-    return std::make_unique<ExprStatement>(std::move(expr));
+    if (failed) {
+        ast = AbstractSyntaxTree();
+        return parseFromScratch();
+    }
+
+    ast.source = std::move(source);
+    ast.arenas.push_back(std::move(parser.arena));
+
+    for (FunctionSource& function : functionSources) {
+        ast.liveNodeBytes += function.nodeBytes;
+    }
+
+    for (size_t i = last; i < sources.size(); i++) {
+        sources[i].begin = moved(sources[i].begin);
+        sources[i].end = moved(sources[i].end);
+    }
+
+    ast.functions.erase(ast.functions.begin() + first, ast.functions.begin() + last);
+    ast.functions.insert(ast.functions.begin() + first, functions.begin(), functions.end());
+    sources.erase(sources.begin() + first, sources.begin() + last);
+    sources.insert(sources.begin() + first, functionSources.begin(), functionSources.end());
+
+    // by symbol like getExternFunctions(), names new to the interner come last
+    ast.externFunctions.clear();
+
+    for (SymbolId symbol = 0; symbol < tallies.size(); symbol++) {
+        if (tallies[symbol].uses > 0 && tallies[symbol].definitions == 0) {
+            ast.addExternFunction(std::string(ast.interner->name(symbol)),
+                                  tallies[symbol].paramCount);
+        }
+    }
+
+    return previous;
 }
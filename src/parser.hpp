@@ -1,72 +1,137 @@
 #pragma once
 
 #include <memory>
+#include <optional>
 #include <string>
-#include <unordered_map>
-#include <unordered_set>
 #include <vector>
+#include "arena.hpp"
 #include "ast.hpp"
+#include "interner.hpp"
 #include "lexer.hpp"
 
 namespace clonk {
 
+// Replacement of the bytes [begin, oldEnd) of a program text by the bytes [begin, newEnd) of the
+// edited text
+struct TextEdit {
+    size_t begin;
+    size_t oldEnd;
+    size_t newEnd;
+};
+
 class Parser {
 
     TokenStream& ts;
-    SymbolTable<std::string> scopes;
+    std::unique_ptr<Arena> arena = std::make_unique<Arena>();  // handed to the AST when done
+    SymbolTable<const Identifier*> scopes;  // maps names to their declaring identifier
+
+    // function parameter counts, indexed by SymbolId
+    std::vector<std::optional<size_t>> paramCounts;
+    std::vector<bool> declaredFunctions;
+    std::vector<const Identifier*> autoDecls;
+    uint32_t slotCount = 0;  // variables declared in the current function so far
+    std::vector<ParamCountUse> paramCountUses;
+    FunctionSource lastFunction;  // of the function last returned by parseNextFunction()
+
+    // parses part of a program for parseProgramParallel() or reparse(), aborts on fatal errors
+    bool isWorker = false;
 
-    // function parameter counts
-    std::unordered_map<std::string, size_t> paramCounts;
-    std::unordered_set<std::string> declaredFunctions;
-    std::vector<std::string_view> autoDecls;
-    
    public:
     Parser(TokenStream& ts) : ts(ts) {}
 
     AbstractSyntaxTree parseProgram() {
         AbstractSyntaxTree ast;
+        ast.source = ts.getSource();
+        ast.interner = ts.getInterner();
+
+        while (auto function = parseNextFunction()) {
+            ast.addFunction(function, lastFunction);
+        }
+
+        for (auto& [name, paramCount] : getExternFunctions()) {
+            ast.addExternFunction(name, paramCount);
+        }
 
-        std::vector<std::unique_ptr<Function>> functions;
+        ast.arenas.push_back(std::move(arena));
+        arena = std::make_unique<Arena>();
+        return ast;
+    }
 
-        while (!ts.empty()) {
-            ast.addFunction(parseFunction());
+    /**
+     * Like parseProgram(), but parses ranges of functions on up to threads threads if the stream
+     * is tokenized by tokenizeAll(). Every thread has its own scopes, call arity tables and
+     * arena, the tables are merged in program order afterwards. If any thread reports an error,
+     * the program is parsed again sequentially, so diagnostics are exactly those of
+     * parseProgram().
+     */
+    AbstractSyntaxTree parseProgramParallel(unsigned threads);
+
+    /**
+     * Tree of source, the text of previous after edit. Only the top-level functions the edit
+     * touches are lexed and parsed again, the others are taken over from previous along with
+     * the arenas holding them. Parameter counts are checked across the whole program against
+     * per name tallies of all calls, which only the replaced and the new functions update.
+     *
+     * previous has to come from an error-free parse. If the edited part does not parse cleanly,
+     * its tokens run into the following function, or the arenas hold more replaced nodes than
+     * live ones, source is parsed from scratch, so diagnostics are exactly those of
+     * parseProgram().
+     */
+    static AbstractSyntaxTree reparse(AbstractSyntaxTree previous,
+                                      std::shared_ptr<const SourceBuffer> source,
+                                      const TextEdit& edit);
+
+    // Parses the next top-level function, returns nullptr at the end of the input. Allows
+    // processing a program function by function without keeping the whole AST in memory.
+    Function* parseNextFunction() {
+        if (ts.empty()) {
+            return nullptr;
         }
 
-        for (const auto& entry : paramCounts) {
-            if (declaredFunctions.find(entry.first) == declaredFunctions.end()) {
-                ast.addExternFunction(entry.first, entry.second);
+        return parseFunction();
+    }
+
+    // Frees all functions returned by parseNextFunction() so far
+    void releaseNodes() { arena->reset(); }
+
+    // Functions that are called but not defined in the program parsed so far
+    std::vector<std::pair<std::string, int>> getExternFunctions() const {
+        std::vector<std::pair<std::string, int>> externFunctions;
+
+        for (SymbolId symbol = 0; symbol < paramCounts.size(); symbol++) {
+            bool declared = symbol < declaredFunctions.size() && declaredFunctions[symbol];
+
+            if (paramCounts[symbol] && !declared) {
+                externFunctions.emplace_back(ts.getInterner()->name(symbol), *paramCounts[symbol]);
             }
         }
 
-        return ast;
+        return externFunctions;
     }
 
    private:
     void parsingError();
 
-    void matchToken(TokenType type, const std::string& expected = "");
-
-    void checkFunctionParamCounts(const std::string& name, size_t paramCount);
+    // for errors parsing can not continue after
+    [[noreturn]] void fatalError();
 
-    std::unique_ptr<Identifier> parseIdentifier();
-
-    std::unique_ptr<Expression> parseExpression();
+    void matchToken(TokenType type, const std::string& expected = "");
 
-    std::unique_ptr<Expression> parseTerm();
+    void checkFunctionParamCounts(const Identifier& ident, size_t paramCount);
 
-    std::unique_ptr<Block> parseBlock();
+    Identifier* parseIdentifier();
 
-    std::unique_ptr<Expression> parseValue(bool lvalue = false);
+    void checkAddressOf(const Expression* operand);
 
-    std::vector<std::unique_ptr<Identifier>> parseParamlist();
+    Expression* parseExpression();
 
-    std::vector<std::unique_ptr<Expression>> parseFunctionCallParamList();
+    Block* parseBlock();
 
-    std::unique_ptr<Function> parseFunction();
+    std::vector<Identifier*> parseParamlist();
 
-    std::unique_ptr<Statement> parseDeclStatement();
+    Function* parseFunction();
 
-    std::unique_ptr<Statement> parseStatement();
+    Statement* parseDeclaration();
 };
 
 }  // end namespace clonk
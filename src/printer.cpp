@@ -0,0 +1,298 @@
+#include "printer.hpp"
+#include <array>
+#include <string>
+#include "ast.hpp"
+#include "flat_ast.hpp"
+#include "lexer.hpp"
+
+using namespace clonk;
+
+static std::string_view opName(TokenType op) {
+    static const std::array<std::string, EndOfStatement + 1> names = [] {
+        std::array<std::string, EndOfStatement + 1> names;
+        for (int type = 0; type <= EndOfStatement; type++) {
+            names[type] = opToString(TokenType(type));
+        }
+        return names;
+    }();
+
+    return names[op];
+}
+
+namespace {
+
+// What printNodes() needs to know about a node of either representation. Children are numbered
+// in the order they are printed, absent ones are none.
+struct NodeTree {
+    using Node = const ASTNode*;
+    static constexpr Node none = nullptr;
+
+    NodeKind kind(Node node) const { return node->kind; }
+
+    std::string_view name(Node node) const {
+        switch (node->kind) {
+            case NodeKind::FunctionCall: return static_cast<const FunctionCall*>(node)->ident->name;
+            case NodeKind::Declaration: return static_cast<const Declaration*>(node)->ident->name;
+            default: return static_cast<const Identifier*>(node)->name;
+        }
+    }
+
+    uint64_t value(Node node) const { return static_cast<const IntLiteral*>(node)->value; }
+
+    TokenType op(Node node) const {
+        if (node->kind == NodeKind::UnOp) {
+            return static_cast<const UnOp*>(node)->op;
+        }
+
+        return static_cast<const BinOp*>(node)->op;
+    }
+
+    int sizeSpec(Node node) const { return static_cast<const IndexExpr*>(node)->sizeSpec; }
+
+    Node child(Node node, int index) const {
+        switch (node->kind) {
+            case NodeKind::BinOp: {
+                auto binOp = static_cast<const BinOp*>(node);
+                return index == 0 ? binOp->leftExpr : binOp->rightExpr;
+            }
+            case NodeKind::UnOp: return static_cast<const UnOp*>(node)->expr;
+            case NodeKind::IndexExpr: {
+                auto indexExpr = static_cast<const IndexExpr*>(node);
+                return index == 0 ? indexExpr->array : indexExpr->idx;
+            }
+            case NodeKind::Declaration: return static_cast<const Declaration*>(node)->expr;
+            case NodeKind::WhileStatement: {
+                auto whileStmt = static_cast<const WhileStatement*>(node);
+                return index == 0 ? static_cast<Node>(whileStmt->condition) : whileStmt->statement;
+            }
+            case NodeKind::IfStatement: {
+                auto ifStmt = static_cast<const IfStatement*>(node);
+                return index == 0   ? static_cast<Node>(ifStmt->condition)
+                       : index == 1 ? ifStmt->statement
+                                    : ifStmt->elseStatement.value_or(nullptr);
+            }
+            case NodeKind::ExprStatement: return static_cast<const ExprStatement*>(node)->expr;
+            case NodeKind::ReturnStatement:
+                return static_cast<const ReturnStatement*>(node)->expr.value_or(nullptr);
+            default: return nullptr;
+        }
+    }
+
+    // statements of a block, parameters of a call
+    size_t listSize(Node node) const {
+        if (node->kind == NodeKind::Block) {
+            return static_cast<const Block*>(node)->statements.size();
+        }
+
+        return static_cast<const FunctionCall*>(node)->paramList.size();
+    }
+
+    Node listElement(Node node, size_t index) const {
+        if (node->kind == NodeKind::Block) {
+            return static_cast<const Block*>(node)->statements[index];
+        }
+
+        return static_cast<const FunctionCall*>(node)->paramList[index];
+    }
+};
+
+struct FlatTree {
+    using Node = NodeIndex;
+    static constexpr Node none = noNode;
+
+    const FlatAST& ast;
+
+    NodeKind kind(Node node) const { return ast.node(node).kind; }
+    std::string_view name(Node node) const { return ast.name(ast.node(node).lhs); }
+    uint64_t value(Node node) const { return ast.literal(ast.node(node)); }
+    TokenType op(Node node) const { return TokenType(ast.node(node).data); }
+    int sizeSpec(Node node) const { return ast.node(node).data; }
+
+    Node child(Node node, int index) const {
+        const FlatNode& flat = ast.node(node);
+
+        if (flat.kind == NodeKind::Declaration) {
+            return flat.rhs;
+        }
+
+        return index == 0 ? flat.lhs : index == 1 ? flat.rhs : flat.extra;
+    }
+
+    size_t listSize(Node node) const { return ast.node(node).extra; }
+
+    Node listElement(Node node, size_t index) const {
+        const FlatNode& flat = ast.node(node);
+        return ast.list(flat.rhs, flat.extra)[index];
+    }
+};
+
+}  // namespace
+
+template <typename Tree>
+void ASTPrinter::printNodes(const Tree& tree, typename Tree::Node root,
+                            std::vector<Pending<typename Tree::Node>>& pending) {
+    using Node = typename Tree::Node;
+
+    auto text = [&](std::string_view text, int number = -1) {
+        pending.push_back({Tree::none, text, number});
+    };
+
+    auto child = [&](Node node) { pending.push_back({node}); };
+
+    pending.push_back({root});
+
+    while (!pending.empty()) {
+        Pending<Node> next = pending.back();
+        pending.pop_back();
+
+        if (next.node == Tree::none) {
+            buffer.write(next.text);
+            if (next.number >= 0) {
+                buffer.writeNumber(next.number);
+            }
+            continue;
+        }
+
+        Node node = next.node;
+
+        // the text after the children is pushed first, children in reverse
+        switch (tree.kind(node)) {
+            case NodeKind::Identifier: buffer.write(tree.name(node)); break;
+            case NodeKind::IntLiteral: buffer.writeNumber(tree.value(node)); break;
+            case NodeKind::BinOp: {
+                buffer.write("(");
+                buffer.write(opName(tree.op(node)));
+                buffer.write(" ");
+                text(")");
+                child(tree.child(node, 1));
+                text(" ");
+                child(tree.child(node, 0));
+                break;
+            }
+            case NodeKind::UnOp: {
+                buffer.write("(");
+                buffer.write(opName(tree.op(node)));
+                buffer.write(" ");
+                text(")");
+                child(tree.child(node, 0));
+                break;
+            }
+            case NodeKind::IndexExpr: {
+                buffer.write("([] ");
+                text(")");
+                text("@", tree.sizeSpec(node));
+                child(tree.child(node, 1));
+                text(" ");
+                child(tree.child(node, 0));
+                break;
+            }
+            case NodeKind::FunctionCall: {
+                buffer.write("(function call ");
+                buffer.write(tree.name(node));
+                text(")");
+                for (size_t i = tree.listSize(node); i-- > 0;) {
+                    child(tree.listElement(node, i));
+                    text(" ");
+                }
+                break;
+            }
+            case NodeKind::Declaration: {
+                buffer.write("(decl ");
+                buffer.write(tree.name(node));
+                buffer.write(" ");
+
+                if (tree.child(node, 0) == Tree::none) {
+                    buffer.write("()\n");
+                } else {
+                    text(")\n");
+                    child(tree.child(node, 0));
+                }
+                break;
+            }
+            case NodeKind::WhileStatement: {
+                buffer.write("(while ");
+                text(")\n");
+                child(tree.child(node, 1));
+                text(" ");
+                child(tree.child(node, 0));
+                break;
+            }
+            case NodeKind::IfStatement: {
+                buffer.write("(if ");
+                text(")");
+                if (tree.child(node, 2) != Tree::none) {
+                    text(")\n");
+                    child(tree.child(node, 2));
+                    text(" (else ");
+                }
+                child(tree.child(node, 1));
+                text(" ");
+                child(tree.child(node, 0));
+                break;
+            }
+            case NodeKind::ExprStatement: {
+                buffer.write("(expr statement ");
+                text(")\n");
+                child(tree.child(node, 0));
+                break;
+            }
+            case NodeKind::ReturnStatement: {
+                buffer.write("(return ");
+                text(")\n");
+                if (tree.child(node, 0) == Tree::none) {
+                    buffer.write("()");
+                } else {
+                    child(tree.child(node, 0));
+                }
+                break;
+            }
+            case NodeKind::Block: {
+                buffer.write("(block \n");
+                text(")");
+                for (size_t i = tree.listSize(node); i-- > 0;) {
+                    child(tree.listElement(node, i));
+                    text(" ");
+                }
+                break;
+            }
+        }
+    }
+}
+
+void ASTPrinter::print(const Function& function) {
+    buffer.write("(function ");
+    buffer.write(function.ident->name);
+    buffer.write(" (params");
+    for (const Identifier* param : function.params) {
+        buffer.write(" ");
+        buffer.write(param->name);
+    }
+    buffer.write(") ");
+
+    printNodes(NodeTree(), function.block, pendingNodes);
+    buffer.write(")\n");
+}
+
+void ASTPrinter::print(const AbstractSyntaxTree& ast) {
+    for (const Function* function : ast.getFunctions()) {
+        print(*function);
+    }
+}
+
+void ASTPrinter::print(const FlatAST& ast) {
+    FlatTree tree{ast};
+
+    for (const FlatFunction& function : ast.getFunctions()) {
+        buffer.write("(function ");
+        buffer.write(ast.name(function.name));
+        buffer.write(" (params");
+        for (SymbolId param : ast.list(function.params, function.paramCount)) {
+            buffer.write(" ");
+            buffer.write(ast.name(param));
+        }
+        buffer.write(") ");
+
+        printNodes(tree, function.body, pendingFlatNodes);
+        buffer.write(")\n");
+    }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <ostream>
+#include <string_view>
+#include <vector>
+#include "ast.hpp"
+#include "flat_ast.hpp"
+
+namespace clonk {
+
+/**
+ * Collects output in a fixed buffer and hands it to the stream in large blocks, so writing a
+ * piece of text is a bounds check and a memcpy.
+ */
+class OutputBuffer {
+    static constexpr size_t capacity = 1 << 16;
+
+    std::ostream& out;
+    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(capacity);
+    size_t used = 0;
+
+   public:
+    explicit OutputBuffer(std::ostream& out) : out(out) {}
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    ~OutputBuffer() { flush(); }
+
+    void write(std::string_view text) {
+        if (text.size() > capacity - used) {
+            flush();
+
+            if (text.size() > capacity) {
+                out.write(text.data(), text.size());
+                return;
+            }
+        }
+
+        std::memcpy(buffer.get() + used, text.data(), text.size());
+        used += text.size();
+    }
+
+    void writeNumber(uint64_t value) {
+        char digits[20];
+        char* end = std::to_chars(digits, digits + sizeof(digits), value).ptr;
+        write({digits, size_t(end - digits)});
+    }
+
+    void flush() {
+        out.write(buffer.get(), used);
+        used = 0;
+    }
+};
+
+/**
+ * Writes the S-expressions of -a straight into an OutputBuffer, in the same format as the
+ * to_string() functions of the nodes. Nodes are visited with an explicit stack of the text
+ * still to be written for their parents, so time is linear in the size of the output and
+ * memory only grows with the nesting depth.
+ */
+class ASTPrinter {
+    OutputBuffer buffer;
+
+    // what is left to print of the enclosing nodes: a node, or text followed by an optional
+    // number
+    template <typename Node>
+    struct Pending {
+        Node node;
+        std::string_view text = {};
+        int number = -1;
+    };
+
+    std::vector<Pending<const ASTNode*>> pendingNodes;
+    std::vector<Pending<NodeIndex>> pendingFlatNodes;
+
+    template <typename Tree>
+    void printNodes(const Tree& tree, typename Tree::Node root,
+                    std::vector<Pending<typename Tree::Node>>& pending);
+
+   public:
+    explicit ASTPrinter(std::ostream& out) : buffer(out) {}
+
+    // Prints one function followed by a newline, as a line of the output for a whole program
+    void print(const Function& function);
+
+    void print(const AbstractSyntaxTree& ast);
+
+    void print(const FlatAST& ast);
+
+    void flush() { buffer.flush(); }
+};
+
+}  // end namespace clonk
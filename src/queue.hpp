@@ -0,0 +1,56 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace clonk {
+
+/**
+ * Lock-free ring of Capacity slots between exactly one producer and one consumer thread.
+ * Slots are filled and read in place: the producer gets a slot with acquireWrite(), fills it and
+ * hands it over with publish(); the consumer reads it after acquireRead() and returns it with
+ * release(). Slot contents are reused, so buffers inside them keep their capacity.
+ */
+template <typename T, size_t Capacity>
+class SPSCQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "capacity must be a power of two");
+
+    std::array<T, Capacity> slots;
+
+    // on separate cache lines, each index is only written by one side
+    alignas(64) std::atomic<size_t> head = 0;  // next slot to read
+    alignas(64) std::atomic<size_t> tail = 0;  // next slot to write
+
+   public:
+    // Producer: slot to fill next, or nullptr if the queue is full
+    T* acquireWrite() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == Capacity) {
+            return nullptr;
+        }
+
+        return &slots[t & (Capacity - 1)];
+    }
+
+    void publish() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer: oldest published slot, or nullptr if the queue is empty
+    T* acquireRead() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+
+        return &slots[h & (Capacity - 1)];
+    }
+
+    void release() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+};
+
+}  // end namespace clonk
@@ -0,0 +1,141 @@
+#include "scan.hpp"
+#include <cstdint>
+#include <string_view>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLONK_SCAN_X86 1
+#endif
+
+using namespace clonk;
+
+// ' ', '\t', '\n', '\v', '\f', '\r'
+static inline bool isWhitespace(char c) {
+    return c == ' ' || static_cast<unsigned char>(c - '\t') <= '\r' - '\t';
+}
+
+static size_t skipWhitespaceScalar(std::string_view input, size_t pos) {
+    while (pos < input.size() && isWhitespace(input[pos])) {
+        pos++;
+    }
+
+    return pos;
+}
+
+static size_t findNewlineScalar(std::string_view input, size_t pos) {
+    while (pos < input.size() && input[pos] != '\n') {
+        pos++;
+    }
+
+    return pos;
+}
+
+#ifdef CLONK_SCAN_X86
+
+__attribute__((target("sse2"))) static size_t skipWhitespaceSSE2(std::string_view input,
+                                                                  size_t pos) {
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i ctrlRange = _mm_set1_epi8('\r' - '\t');
+    const __m128i space = _mm_set1_epi8(' ');
+
+    while (pos + 16 <= input.size()) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input.data() + pos));
+
+        // c - '\t' <= '\r' - '\t' (unsigned) || c == ' '
+        __m128i shifted = _mm_sub_epi8(chunk, tab);
+        __m128i isCtrl = _mm_cmpeq_epi8(_mm_min_epu8(shifted, ctrlRange), shifted);
+        __m128i isSpace = _mm_or_si128(isCtrl, _mm_cmpeq_epi8(chunk, space));
+
+        uint32_t wsMask = _mm_movemask_epi8(isSpace);
+
+        if (wsMask != 0xFFFF) {
+            return pos + __builtin_ctz(~wsMask);
+        }
+
+        pos += 16;
+    }
+
+    return skipWhitespaceScalar(input, pos);
+}
+
+__attribute__((target("sse2"))) static size_t findNewlineSSE2(std::string_view input, size_t pos) {
+    const __m128i newline = _mm_set1_epi8('\n');
+
+    while (pos + 16 <= input.size()) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input.data() + pos));
+        uint32_t nlMask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        if (nlMask) {
+            return pos + __builtin_ctz(nlMask);
+        }
+
+        pos += 16;
+    }
+
+    return findNewlineScalar(input, pos);
+}
+
+__attribute__((target("avx2"))) static size_t skipWhitespaceAVX2(std::string_view input,
+                                                                  size_t pos) {
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i ctrlRange = _mm256_set1_epi8('\r' - '\t');
+    const __m256i space = _mm256_set1_epi8(' ');
+
+    while (pos + 32 <= input.size()) {
+        __m256i chunk =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input.data() + pos));
+
+        __m256i shifted = _mm256_sub_epi8(chunk, tab);
+        __m256i isCtrl = _mm256_cmpeq_epi8(_mm256_min_epu8(shifted, ctrlRange), shifted);
+        __m256i isSpace = _mm256_or_si256(isCtrl, _mm256_cmpeq_epi8(chunk, space));
+
+        uint32_t wsMask = _mm256_movemask_epi8(isSpace);
+
+        if (wsMask != 0xFFFFFFFF) {
+            return pos + __builtin_ctz(~wsMask);
+        }
+
+        pos += 32;
+    }
+
+    return skipWhitespaceSSE2(input, pos);
+}
+
+__attribute__((target("avx2"))) static size_t findNewlineAVX2(std::string_view input, size_t pos) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+
+    while (pos + 32 <= input.size()) {
+        __m256i chunk =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(input.data() + pos));
+        uint32_t nlMask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+
+        if (nlMask) {
+            return pos + __builtin_ctz(nlMask);
+        }
+
+        pos += 32;
+    }
+
+    return findNewlineSSE2(input, pos);
+}
+
+#endif
+
+const ScanKernels& ScanKernels::scalar() {
+    static const ScanKernels kernels = {"scalar", skipWhitespaceScalar, findNewlineScalar};
+    return kernels;
+}
+
+const ScanKernels& ScanKernels::best() {
+#ifdef CLONK_SCAN_X86
+    static const ScanKernels sse2 = {"sse2", skipWhitespaceSSE2, findNewlineSSE2};
+    static const ScanKernels avx2 = {"avx2", skipWhitespaceAVX2, findNewlineAVX2};
+
+    static const ScanKernels& selected = __builtin_cpu_supports("avx2")   ? avx2
+                                         : __builtin_cpu_supports("sse2") ? sse2
+                                                                          : scalar();
+    return selected;
+#else
+    return scalar();
+#endif
+}
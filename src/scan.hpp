@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+namespace clonk {
+
+/**
+ * Set of byte scanning kernels used by the lexer to skip over whitespace and comment bodies.
+ * There is one implementation per instruction set, the best available one is picked at runtime.
+ */
+struct ScanKernels {
+    const char* name;
+
+    // Returns the offset of the first non-whitespace char at or after pos (or input.size())
+    size_t (*skipWhitespace)(std::string_view input, size_t pos);
+
+    // Returns the offset of the first '\n' at or after pos (or input.size())
+    size_t (*findNewline)(std::string_view input, size_t pos);
+
+    static const ScanKernels& scalar();
+
+    static const ScanKernels& best();
+};
+
+}  // end namespace clonk
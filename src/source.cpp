@@ -0,0 +1,161 @@
+#include "source.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "debug.hpp"
+#include "scan.hpp"
+
+using namespace clonk;
+
+SourceBuffer::~SourceBuffer() {
+    if (mapped) {
+        munmap(const_cast<char*>(data), size);
+    }
+}
+
+static bool readAll(int fd, std::string& contents) {
+    char chunk[1 << 16];
+
+    while (true) {
+        ssize_t count = read(fd, chunk, sizeof(chunk));
+
+        if (count == 0) {
+            return true;
+        } else if (count < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return false;
+        }
+
+        contents.append(chunk, count);
+    }
+}
+
+std::shared_ptr<const SourceBuffer> SourceBuffer::open(const std::filesystem::path& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    std::shared_ptr<SourceBuffer> buffer(new SourceBuffer());
+    struct stat info;
+
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        void* mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+
+            buffer->data = static_cast<const char*>(mapping);
+            buffer->size = info.st_size;
+            buffer->mapped = true;
+            close(fd);
+            return buffer;
+        }
+    }
+
+    // pipes and other files that can not be mapped
+    bool success = readAll(fd, buffer->contents);
+    close(fd);
+
+    if (!success) {
+        return nullptr;
+    }
+
+    buffer->data = buffer->contents.data();
+    buffer->size = buffer->contents.size();
+    return buffer;
+}
+
+std::shared_ptr<const SourceBuffer> SourceBuffer::fromString(std::string text) {
+    std::shared_ptr<SourceBuffer> buffer(new SourceBuffer());
+    buffer->contents = std::move(text);
+    buffer->data = buffer->contents.data();
+    buffer->size = buffer->contents.size();
+    return buffer;
+}
+
+std::string_view ChunkedSource::advance(size_t consumed) {
+    buffer.erase(0, consumed);
+    bufferOffset += consumed;
+
+    // the remainder of the last window is a partial line, read until it is complete
+    while (!eof) {
+        size_t oldSize = buffer.size();
+        buffer.resize(oldSize + chunkSize);
+
+        ssize_t count = read(fd, buffer.data() + oldSize, chunkSize);
+        if (count < 0 && errno == EINTR) {
+            buffer.resize(oldSize);
+            continue;
+        }
+
+        // the input would end early, the program read so far may still be valid
+        if (count < 0) {
+            logger::warn("Could not read input: %s\n", std::strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+
+        buffer.resize(oldSize + count);
+        eof = count == 0;
+
+        if (buffer.find('\n', oldSize) != std::string::npos) {
+            break;
+        }
+    }
+
+    size_t complete = eof ? buffer.size() : buffer.rfind('\n') + 1;
+    return std::string_view(buffer).substr(0, complete);
+}
+
+void SourceLocationIndex::build() const {
+    const ScanKernels& kernels = ScanKernels::best();
+    lineStarts.push_back(0);
+
+    for (size_t pos = kernels.findNewline(text, 0); pos < text.size();
+         pos = kernels.findNewline(text, pos + 1)) {
+        lineStarts.push_back(pos + 1);
+    }
+
+    built = true;
+}
+
+void SourceLocationIndex::addWindow(std::string_view window, size_t offset) {
+    assert(streaming);
+    const ScanKernels& kernels = ScanKernels::best();
+
+    for (size_t pos = kernels.findNewline(window, 0); pos < window.size();
+         pos = kernels.findNewline(window, pos + 1)) {
+        lineStarts.push_back(offset + pos + 1);
+    }
+
+    text = window;
+    windowOffset = offset;
+}
+
+SourceLocationIndex::Location SourceLocationIndex::locate(size_t offset) const {
+    if (!built) {
+        build();
+    }
+
+    auto it = std::upper_bound(lineStarts.begin(), lineStarts.end(), offset);
+    size_t line = it - lineStarts.begin();
+    size_t start = lineStarts[line - 1];
+
+    std::string_view lineText;
+    if (start >= windowOffset && start - windowOffset < text.size()) {
+        lineText = text.substr(start - windowOffset);
+        lineText = lineText.substr(0, lineText.find('\n'));
+    }
+
+    return {line, offset - start, lineText};
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace clonk {
+
+/**
+ * Read-only program text. Regular files are memory mapped, everything else (pipes, character
+ * devices) is read into an owned buffer. Shared between the TokenStream and the AST, since
+ * tokens and AST nodes refer to the text through string_views.
+ */
+class SourceBuffer {
+    const char* data = nullptr;
+    size_t size = 0;
+    bool mapped = false;
+    std::string contents;  // only used if the file could not be mapped
+
+    SourceBuffer() = default;
+
+   public:
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+
+    ~SourceBuffer();
+
+    // Returns nullptr if the file can not be opened or read
+    static std::shared_ptr<const SourceBuffer> open(const std::filesystem::path& path);
+
+    static std::shared_ptr<const SourceBuffer> fromString(std::string text);
+
+    std::string_view view() const { return {data, size}; }
+
+    bool isMapped() const { return mapped; }
+};
+
+/**
+ * Program text read incrementally from a pipe or stdin in fixed-size chunks. Only complete lines
+ * are handed out, so a token never spans two windows. Memory is bounded by the chunk size plus
+ * the longest line.
+ */
+class ChunkedSource {
+    int fd;
+    size_t chunkSize;
+    std::string buffer;
+    size_t bufferOffset = 0;  // offset of buffer[0] in the whole input
+    bool eof = false;
+
+   public:
+    explicit ChunkedSource(int fd, size_t chunkSize = 1 << 16) : fd(fd), chunkSize(chunkSize) {}
+
+    /**
+     * Releases the first consumed bytes of the current window and reads until at least one more
+     * complete line is available. Returns the new window, which is empty at the end of input.
+     */
+    std::string_view advance(size_t consumed);
+
+    // offset of the current window in the whole input
+    size_t offset() const { return bufferOffset; }
+};
+
+/**
+ * Maps byte offsets in the program text to line and column. Tokens and diagnostics only carry
+ * offsets, lines are resolved when an error is printed. For whole-file input the table of line
+ * starts is built on first use; streamed input records it window by window, and only the lines
+ * of the current window are still available as text.
+ */
+class SourceLocationIndex {
+    std::string_view text;
+    mutable std::vector<size_t> lineStarts;
+    mutable bool built = false;
+
+    bool streaming = false;
+    size_t windowOffset = 0;
+
+    void build() const;
+
+   public:
+    struct Location {
+        size_t line;    // 1-based
+        size_t column;  // 0-based
+        std::string_view lineText;  // empty if the text is no longer available
+    };
+
+    explicit SourceLocationIndex(std::string_view text) : text(text) {}
+
+    // Streaming mode, text is passed in with addWindow()
+    SourceLocationIndex() : lineStarts{0}, built(true), streaming(true) {}
+
+    // Streaming mode: records the line starts of the next window of input
+    void addWindow(std::string_view window, size_t offset);
+
+    bool isStreaming() const { return streaming; }
+
+    Location locate(size_t offset) const;
+};
+
+}  // end namespace clonk
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cassert>
+#include "ast.hpp"
+
+namespace clonk {
+
+/**
+ * Base for passes over the AST. visit() switches on the node kind and calls the visit function
+ * of Derived for the concrete node type, so dispatch is a single jump without RTTI:
+ *
+ *   struct Pass : NodeVisitor<Pass, int> {
+ *       int visitBinOp(const BinOp* binOp) { return visit(binOp->leftExpr); }
+ *       ...
+ *   };
+ *
+ * Derived has to provide a visit function for every concrete node type.
+ */
+template <typename Derived, typename RetTy = void>
+class NodeVisitor {
+   public:
+    RetTy visit(const ASTNode* node) {
+        Derived& self = static_cast<Derived&>(*this);
+
+        switch (node->kind) {
+            case NodeKind::Identifier:
+                return self.visitIdentifier(static_cast<const Identifier*>(node));
+            case NodeKind::IndexExpr:
+                return self.visitIndexExpr(static_cast<const IndexExpr*>(node));
+            case NodeKind::IntLiteral:
+                return self.visitIntLiteral(static_cast<const IntLiteral*>(node));
+            case NodeKind::BinOp: return self.visitBinOp(static_cast<const BinOp*>(node));
+            case NodeKind::UnOp: return self.visitUnOp(static_cast<const UnOp*>(node));
+            case NodeKind::FunctionCall:
+                return self.visitFunctionCall(static_cast<const FunctionCall*>(node));
+            case NodeKind::Declaration:
+                return self.visitDeclaration(static_cast<const Declaration*>(node));
+            case NodeKind::WhileStatement:
+                return self.visitWhileStatement(static_cast<const WhileStatement*>(node));
+            case NodeKind::IfStatement:
+                return self.visitIfStatement(static_cast<const IfStatement*>(node));
+            case NodeKind::ExprStatement:
+                return self.visitExprStatement(static_cast<const ExprStatement*>(node));
+            case NodeKind::ReturnStatement:
+                return self.visitReturnStatement(static_cast<const ReturnStatement*>(node));
+            case NodeKind::Block: return self.visitBlock(static_cast<const Block*>(node));
+        }
+
+        assert(false && "Unknown node kind");
+        __builtin_unreachable();
+    }
+};
+
+}  // end namespace clonk